@@ -8,5 +8,6 @@ in pkgs.llvmPackages_13.stdenv.mkDerivation rec {
 		(pkgs.opencv4.override {
 			enableGtk3 = true;
 		})
+		pkgs.libtiff
 	];
 }
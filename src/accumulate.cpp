@@ -0,0 +1,500 @@
+#include "accumulate.h"
+#include "pixel_types.h"
+#include <algorithm>
+#include <iostream>
+#include <cmath>
+
+PhaseLUT onProfile(float distance) {
+	return PhaseLUT([=](float phase) {
+		float dist = phase * distance / 2.f;
+		return std::exp(-(dist*dist));
+	});
+}
+
+PhaseLUT offProfile(float distance) {
+	return PhaseLUT([=](float phase) {
+		float dist = (phase >= 0 ? phase - 0.5f : phase + 0.5f) * distance / 4.f;
+		return std::exp(-(dist*dist)) / 2.f;
+	});
+}
+
+// The frame can be any native depth, the accumulators have to be float
+static void checkImages(const cv::Mat & frame, std::initializer_list<const cv::Mat *> accumulators) {
+	CV_Assert(frame.channels() == 1);
+	for (const cv::Mat * image : accumulators) {
+		CV_Assert(image->type() == CV_32FC1 && image->size() == frame.size());
+	}
+}
+
+// Treat continuous images as one long row so the inner loop is as long as possible
+static cv::Size loopSize(const cv::Mat & frame, std::initializer_list<const cv::Mat *> accumulators) {
+	checkImages(frame, accumulators);
+	cv::Size size = frame.size();
+	if (!frame.isContinuous()) {
+		return size;
+	}
+	for (const cv::Mat * image : accumulators) {
+		if (!image->isContinuous()) {
+			return size;
+		}
+	}
+	return cv::Size(size.width * size.height, 1);
+}
+
+// profile(phase) * (in * weight + offset) * gain added to out, only for the pixels in runs.
+// gain_row holds the calibration factors of the row, or is null for uncalibrated frames.
+template <typename T>
+static void accumulateRuns(const T * in, float weight, float offset, const float * gain_row,
+		const LineGeometry & lines, int y, const PhaseLUT & profile,
+		const std::vector<cv::Range> & runs, std::vector<float> & phase, float * out) {
+	const float * lut = profile.values.data();
+	for (const cv::Range & run : runs) {
+		lines.wrappedPhaseRow(y, phase.data(), run.size(), run.start);
+		const T * __restrict run_in = in + run.start;
+		float * __restrict run_out = out + run.start;
+		if (gain_row) {
+			const float * __restrict run_gain = gain_row + run.start;
+			for (int x = 0; x < run.size(); ++x) {
+				run_out[x] += lut[profile.index(phase[x])] * (run_in[x] * weight + offset) * run_gain[x];
+			}
+		} else {
+			for (int x = 0; x < run.size(); ++x) {
+				run_out[x] += lut[profile.index(phase[x])] * (run_in[x] * weight + offset);
+			}
+		}
+	}
+}
+
+// Factors of row y for the pixels in either list of runs
+static void gainRuns(const FrameGain & gain, int y, const std::vector<cv::Range> & on_runs, const std::vector<cv::Range> & off_runs, float * gain_row) {
+	for (const std::vector<cv::Range> * runs : {&on_runs, &off_runs}) {
+		for (const cv::Range & run : *runs) {
+			gain.row(y, gain_row + run.start, run.size(), run.start);
+		}
+	}
+}
+
+// Shared by the plain and the calibrated variant, the gain lookups are compiled out for the plain one
+template <bool calibrated>
+static void accumulateOnOffImpl(const cv::Mat & frame, float blacklevel, float weight, const FrameGain * gain,
+		const LineGeometry & lines, const PhaseLUT & on_profile, const PhaseLUT & off_profile,
+		cv::Mat & on_result, cv::Mat & off_result, float threshold) {
+	checkImages(frame, {&on_result, &off_result});
+	cv::Size size = frame.size();
+	// (frame - blacklevel) * weight == frame * weight - blacklevel * weight
+	float offset = -blacklevel * weight;
+	std::vector<float> phase(size.width);
+	std::vector<float> gain_row(calibrated ? size.width : 0);
+
+	if (threshold > 0) {
+		PhaseLUT::Band on_band = on_profile.support(threshold);
+		PhaseLUT::Band off_band = off_profile.support(threshold);
+		std::vector<cv::Range> on_runs;
+		std::vector<cv::Range> off_runs;
+		const float * row_gain = calibrated ? gain_row.data() : nullptr;
+		dispatchNativeDepth(frame.depth(), [&]<typename T>(const T *) {
+			for (int y = 0; y < size.height; ++y) {
+				lines.bandRuns(y, size.width, on_band.center, on_band.radius, on_runs);
+				lines.bandRuns(y, size.width, off_band.center, off_band.radius, off_runs);
+				if constexpr (calibrated) {
+					gainRuns(*gain, y, on_runs, off_runs, gain_row.data());
+				}
+				const T * in = frame.ptr<T>(y);
+				accumulateRuns(in, weight, offset, row_gain, lines, y, on_profile, on_runs, phase, on_result.ptr<float>(y));
+				accumulateRuns(in, weight, offset, row_gain, lines, y, off_profile, off_runs, phase, off_result.ptr<float>(y));
+			}
+		});
+		return;
+	}
+
+	const float * on_lut = on_profile.values.data();
+	const float * off_lut = off_profile.values.data();
+	dispatchNativeDepth(frame.depth(), [&]<typename T>(const T *) {
+		for (int y = 0; y < size.height; ++y) {
+			lines.wrappedPhaseRow(y, phase.data(), size.width);
+			if constexpr (calibrated) {
+				gain->row(y, gain_row.data(), size.width);
+			}
+			const T * __restrict in = frame.ptr<T>(y);
+			const float * __restrict g = gain_row.data();
+			float * __restrict on = on_result.ptr<float>(y);
+			float * __restrict off = off_result.ptr<float>(y);
+			for (int x = 0; x < size.width; ++x) {
+				float value = in[x] * weight + offset;
+				if constexpr (calibrated) {
+					value *= g[x];
+				}
+				on[x] += on_lut[on_profile.index(phase[x])] * value;
+				off[x] += off_lut[off_profile.index(phase[x])] * value;
+			}
+		}
+	});
+}
+
+void accumulateOnOff(const cv::Mat & frame, float blacklevel, float weight,
+		const LineGeometry & lines, const PhaseLUT & on_profile, const PhaseLUT & off_profile,
+		cv::Mat & on_result, cv::Mat & off_result, float threshold) {
+	accumulateOnOffImpl<false>(frame, blacklevel, weight, nullptr, lines, on_profile, off_profile, on_result, off_result, threshold);
+}
+
+void accumulateOnOff(const cv::Mat & frame, float blacklevel, float weight, const FrameGain & gain,
+		const LineGeometry & lines, const PhaseLUT & on_profile, const PhaseLUT & off_profile,
+		cv::Mat & on_result, cv::Mat & off_result, float threshold) {
+	accumulateOnOffImpl<true>(frame, blacklevel, weight, &gain, lines, on_profile, off_profile, on_result, off_result, threshold);
+}
+
+void accumulateWeighted(const cv::Mat & frame, float blacklevel, float weight, cv::Mat & result) {
+	cv::Size size = loopSize(frame, {&result});
+	float offset = -blacklevel * weight;
+	dispatchNativeDepth(frame.depth(), [&]<typename T>(const T *) {
+		for (int y = 0; y < size.height; ++y) {
+			const T * __restrict in = frame.ptr<T>(y);
+			float * __restrict out = result.ptr<float>(y);
+			for (int x = 0; x < size.width; ++x) {
+				out[x] += in[x] * weight + offset;
+			}
+		}
+	});
+}
+
+void accumulateLockIn(const cv::Mat & frame, float blacklevel, float weight, double scan_phase, cv::Mat & cos_result, cv::Mat & sin_result) {
+	cv::Size size = loopSize(frame, {&cos_result, &sin_result});
+	float cos_weight = weight * std::cos(2 * M_PI * scan_phase);
+	float sin_weight = weight * std::sin(2 * M_PI * scan_phase);
+	dispatchNativeDepth(frame.depth(), [&]<typename T>(const T *) {
+		for (int y = 0; y < size.height; ++y) {
+			const T * __restrict in = frame.ptr<T>(y);
+			float * __restrict cos_out = cos_result.ptr<float>(y);
+			float * __restrict sin_out = sin_result.ptr<float>(y);
+			for (int x = 0; x < size.width; ++x) {
+				float value = in[x] - blacklevel;
+				cos_out[x] += value * cos_weight;
+				sin_out[x] += value * sin_weight;
+			}
+		}
+	});
+}
+
+// Inserts the values of frame into low and / or high, either may be null
+static void insertOrderStatistics(const cv::Mat & frame, float blacklevel, float weight, const std::vector<cv::Mat> * low, const std::vector<cv::Mat> * high) {
+	for (const std::vector<cv::Mat> * planes : {low, high}) {
+		if (planes) {
+			for (const cv::Mat & plane : *planes) {
+				checkImages(frame, {&plane});
+			}
+		}
+	}
+	cv::Size size = frame.size();
+	float offset = -blacklevel * weight;
+	// Value on its way through the planes of a row
+	std::vector<float> carry(size.width);
+	float * __restrict value = carry.data();
+	dispatchNativeDepth(frame.depth(), [&]<typename T>(const T *) {
+		for (int y = 0; y < size.height; ++y) {
+			const T * __restrict in = frame.ptr<T>(y);
+			if (low) {
+				for (int x = 0; x < size.width; ++x) {
+					value[x] = in[x] * weight + offset;
+				}
+				// The smaller one stays, the larger one moves on
+				for (cv::Mat plane : *low) {
+					float * __restrict smallest = plane.ptr<float>(y);
+					for (int x = 0; x < size.width; ++x) {
+						float kept = smallest[x];
+						smallest[x] = std::min(kept, value[x]);
+						value[x] = std::max(kept, value[x]);
+					}
+				}
+			}
+			if (high) {
+				for (int x = 0; x < size.width; ++x) {
+					value[x] = in[x] * weight + offset;
+				}
+				for (cv::Mat plane : *high) {
+					float * __restrict largest = plane.ptr<float>(y);
+					for (int x = 0; x < size.width; ++x) {
+						float kept = largest[x];
+						largest[x] = std::max(kept, value[x]);
+						value[x] = std::min(kept, value[x]);
+					}
+				}
+			}
+		}
+	});
+}
+
+void accumulateOrderStatistics(const cv::Mat & frame, float blacklevel, float weight, const std::vector<cv::Mat> & low, const std::vector<cv::Mat> & high) {
+	insertOrderStatistics(frame, blacklevel, weight, &low, &high);
+}
+
+void mergeOrderStatistics(const std::vector<cv::Mat> & other_low, const std::vector<cv::Mat> & other_high, const std::vector<cv::Mat> & low, const std::vector<cv::Mat> & high) {
+	// Values of the other frames that are in neither of their lists can not be in the merged ones
+	for (const cv::Mat & plane : other_low) {
+		insertOrderStatistics(plane, 0, 1, &low, nullptr);
+	}
+	for (const cv::Mat & plane : other_high) {
+		insertOrderStatistics(plane, 0, 1, nullptr, &high);
+	}
+}
+
+QuantileSketch::QuantileSketch(float p)
+	: p(p), targets{0, p / 2, p, 0.5f, 1 - p, 1 - p / 2, 1} {
+}
+
+void QuantileSketch::reset(cv::Size size) {
+	if (markers.frameSize() != size) {
+		markers = Stack(2 * num_markers - 2, size, CV_32FC1, Stack::Layout::PixelMajor);
+	}
+}
+
+// One P-square step for a pixel with n > num_markers - 1 values so far. height and rank are the markers of
+// the pixel, desired the ranks the markers should have after value is added.
+template <int num_markers>
+static void updateMarkers(float * height, float * inner_rank, float value, int n, const std::array<float, num_markers> & desired) {
+	float rank[num_markers];
+	rank[0] = 1;
+	std::copy(inner_rank, inner_rank + num_markers - 2, rank + 1);
+	rank[num_markers - 1] = n;
+
+	// Cell k with height[k] <= value < height[k + 1], the extremes move along
+	int k = 0;
+	if (value < height[0]) {
+		height[0] = value;
+	} else if (value >= height[num_markers - 1]) {
+		height[num_markers - 1] = value;
+		k = num_markers - 2;
+	} else {
+		while (value >= height[k + 1]) {
+			k++;
+		}
+	}
+	for (int i = k + 1; i < num_markers; ++i) {
+		rank[i] += 1;
+	}
+
+	// Inner markers more than a rank off move by one, along the parabola through their neighbours if it stays monotonic
+	for (int i = 1; i < num_markers - 1; ++i) {
+		float d = desired[i] - rank[i];
+		if ((d >= 1 && rank[i + 1] - rank[i] > 1) || (d <= -1 && rank[i - 1] - rank[i] < -1)) {
+			int s = d > 0 ? 1 : -1;
+			float parabolic = height[i] + s / (rank[i + 1] - rank[i - 1]) * (
+					(rank[i] - rank[i - 1] + s) * (height[i + 1] - height[i]) / (rank[i + 1] - rank[i])
+					+ (rank[i + 1] - rank[i] - s) * (height[i] - height[i - 1]) / (rank[i] - rank[i - 1]));
+			if (height[i - 1] < parabolic && parabolic < height[i + 1]) {
+				height[i] = parabolic;
+			} else {
+				height[i] += s * (height[i + s] - height[i]) / (rank[i + s] - rank[i]);
+			}
+			rank[i] += s;
+		}
+	}
+	std::copy(rank + 1, rank + num_markers - 1, inner_rank);
+}
+
+void QuantileSketch::add(const cv::Mat & frame_roi, cv::Rect roi, int n, float blacklevel, float weight) {
+	CV_Assert(frame_roi.channels() == 1 && frame_roi.size() == roi.size());
+	cv::Size size = markers.frameSize();
+	cv::Mat state = markers.pixelMajor();
+	float offset = -blacklevel * weight;
+	// Ranks the markers should have once the frame is added, the same for every pixel
+	std::array<float, num_markers> desired;
+	for (int i = 0; i < num_markers; ++i) {
+		desired[i] = 1 + n * targets[i];
+	}
+	dispatchNativeDepth(frame_roi.depth(), [&]<typename T>(const T *) {
+		for (int y = 0; y < roi.height; ++y) {
+			const T * in = frame_roi.ptr<T>(y);
+			for (int x = 0; x < roi.width; ++x) {
+				float * height = state.ptr<float>((roi.y + y) * size.width + roi.x + x);
+				float * inner_rank = height + num_markers;
+				float value = in[x] * weight + offset;
+				if (n >= num_markers) {
+					updateMarkers<num_markers>(height, inner_rank, value, n, desired);
+					continue;
+				}
+				// The first values are kept sorted, then they become the markers at their ranks
+				int j = n;
+				for (; j > 0 && height[j - 1] > value; --j) {
+					height[j] = height[j - 1];
+				}
+				height[j] = value;
+				if (n == num_markers - 1) {
+					for (int i = 1; i < num_markers - 1; ++i) {
+						inner_rank[i - 1] = i + 1;
+					}
+				}
+			}
+		}
+	});
+}
+
+void QuantileSketch::quantiles(int num_frames, cv::Mat & low, cv::Mat & high) const {
+	CV_Assert(num_frames > 0);
+	cv::Size size = markers.frameSize();
+	cv::Mat state = markers.pixelMajor();
+	low.create(size, CV_32FC1);
+	high.create(size, CV_32FC1);
+	// Markers p and 1 - p, or the exact ranks while all values are still kept
+	int low_index = 2;
+	int high_index = 4;
+	if (num_frames < num_markers) {
+		low_index = std::round(p * (num_frames - 1));
+		high_index = num_frames - 1 - low_index;
+	}
+	for (int y = 0; y < size.height; ++y) {
+		float * low_row = low.ptr<float>(y);
+		float * high_row = high.ptr<float>(y);
+		for (int x = 0; x < size.width; ++x) {
+			const float * height = state.ptr<float>(y * size.width + x);
+			low_row[x] = height[low_index];
+			high_row[x] = height[high_index];
+		}
+	}
+}
+
+ReassignmentTable::ReassignmentTable(const LineGeometry & lines, cv::Size size, const PhaseLUT & profile, float threshold, float fraction)
+	: size(size) {
+	PhaseLUT::Band band = profile.support(threshold);
+	// Unit normal of the lines, the direction the phase grows in
+	cv::Point2d normal(lines.phase_dx * lines.distance, lines.phase_dy * lines.distance);
+	std::vector<cv::Range> runs;
+	std::vector<float> phase(size.width);
+	for (int y = 0; y < size.height; ++y) {
+		lines.bandRuns(y, size.width, band.center, band.radius, runs);
+		for (const cv::Range & run : runs) {
+			lines.wrappedPhaseRow(y, phase.data(), run.size(), run.start);
+			for (int j = 0; j < run.size(); ++j) {
+				int x = run.start + j;
+				// Pixels from phase distance to the line center, moved back by fraction of it
+				double shift = -fraction * phase[j] * lines.distance;
+				int target_x = std::lround(x + shift * normal.x);
+				int target_y = std::lround(y + shift * normal.y);
+				if (target_x < 0 || target_x >= size.width || target_y < 0 || target_y >= size.height) {
+					continue;
+				}
+				entries.push_back(Entry{y * size.width + x, target_y * size.width + target_x, profile(phase[j])});
+			}
+		}
+	}
+}
+
+void accumulateReassigned(const cv::Mat & frame, float blacklevel, float weight, const ReassignmentTable & table, cv::Mat & result) {
+	checkImages(frame, {&result});
+	CV_Assert(frame.size() == table.size && frame.isContinuous() && result.isContinuous());
+	float offset = -blacklevel * weight;
+	float * out = result.ptr<float>();
+	dispatchNativeDepth(frame.depth(), [&]<typename T>(const T *) {
+		const T * in = frame.ptr<T>();
+		for (const ReassignmentTable::Entry & entry : table.entries) {
+			out[entry.target] += entry.weight * (in[entry.source] * weight + offset);
+		}
+	});
+}
+
+std::vector<cv::Rect> makeTiles(cv::Size size, int tile_size) {
+	std::vector<cv::Rect> tiles;
+	for (int y = 0; y < size.height; y += tile_size) {
+		for (int x = 0; x < size.width; x += tile_size) {
+			tiles.push_back(cv::Rect(x, y, std::min(tile_size, size.width - x), std::min(tile_size, size.height - y)));
+		}
+	}
+	return tiles;
+}
+
+BatchAccumulator::BatchAccumulator(int threads, int tile_size, int batch_frames)
+	: threads(threads), tile_size(tile_size), batch_frames(batch_frames) {
+}
+
+int BatchAccumulator::run(PrefetchReader & reader, int num_frames, int planes, const Callbacks & callbacks, float on_initial, float off_initial) {
+	bool tiled = tile_size > 0;
+	num_workers = tiled ? 1 : std::max(1, std::min(threads, num_frames));
+	this->planes = planes;
+	int batch_capacity = tiled ? std::max(1, std::min(batch_frames, num_frames)) : num_workers;
+	pages.resize(batch_capacity);
+	images.resize(batch_capacity);
+	converted_pages.resize(batch_capacity);
+
+	cv::Size frame_size;
+	int frames_read = 0;
+	while (frames_read < num_frames) {
+		int batch_size = 0;
+		while (batch_size < std::min(batch_capacity, num_frames - frames_read) && reader.read(pages[batch_size])) {
+			batch_size++;
+		}
+		if (batch_size == 0) {
+			break;
+		}
+		if (frames_read == 0) {
+			frame_size = pages[0].size();
+			if (callbacks.start && !callbacks.start(frame_size)) {
+				return -1;
+			}
+			// Kept from one run to the next if the layout stays the same
+			int num_partials = num_workers * planes;
+			if (num_partials == 0) {
+				on_partial = Stack();
+				off_partial = Stack();
+			} else {
+				if (on_partial.size() != num_partials || on_partial.frameSize() != frame_size) {
+					on_partial = Stack(num_partials, frame_size, CV_32FC1);
+					off_partial = Stack(num_partials, frame_size, CV_32FC1);
+				}
+				on_partial.frameMajor().setTo(on_initial);
+				off_partial.frameMajor().setTo(off_initial);
+			}
+		}
+		for (int b = 0; b < batch_size; ++b) {
+			if (pages[b].size() != frame_size) {
+				std::cerr << "Page " << frames_read + b << " differs in size from the first page" << std::endl;
+				return -1;
+			}
+		}
+
+		auto prepare_frame = [&](int b) {
+			if (isNativeDepth(pages[b].depth())) {
+				images[b] = pages[b];
+			} else {
+				pages[b].convertTo(converted_pages[b], CV_32FC1);
+				images[b] = converted_pages[b];
+			}
+			callbacks.prepare(images[b], frames_read + b);
+		};
+		if (tiled) {
+			cv::parallel_for_(cv::Range(0, batch_size), [&](const cv::Range & range) {
+				for (int b = range.start; b < range.end; ++b) {
+					prepare_frame(b);
+				}
+			}, batch_size);
+			std::vector<cv::Rect> tiles = makeTiles(frame_size, tile_size);
+			cv::parallel_for_(cv::Range(0, int(tiles.size())), [&](const cv::Range & range) {
+				for (int t = range.start; t < range.end; ++t) {
+					for (int b = 0; b < batch_size; ++b) {
+						callbacks.accumulate(images[b], frames_read + b, tiles[t], 0);
+					}
+				}
+			});
+		} else {
+			cv::parallel_for_(cv::Range(0, batch_size), [&](const cv::Range & range) {
+				for (int w = range.start; w < range.end; ++w) {
+					prepare_frame(w);
+					callbacks.accumulate(images[w], frames_read + w, cv::Rect(cv::Point(0, 0), frame_size), w);
+				}
+			}, batch_size);
+		}
+
+		if (callbacks.batch_done) {
+			callbacks.batch_done(images, frames_read, batch_size);
+		}
+		frames_read += batch_size;
+	}
+	return frames_read;
+}
+
+void BatchAccumulator::sum(cv::Mat & on_result, cv::Mat & off_result) const {
+	on_result = on_partial[0].clone();
+	off_result = off_partial[0].clone();
+	for (int w = 1; w < num_workers; ++w) {
+		on_result += on_partial[w * planes];
+		off_result += off_partial[w * planes];
+	}
+}
@@ -0,0 +1,161 @@
+#pragma once
+#include <opencv2/core/core.hpp>
+#include "lines.h"
+#include "calibration.h"
+#include "frames.h"
+#include "stack.h"
+#include <vector>
+#include <array>
+#include <functional>
+#include <stdint.h>
+
+// Mask profiles of the masked subtraction across one line period, for lines distance pixels apart.
+// The masks of all frames are the same profiles, each frame just looks them up at its own line phase.
+PhaseLUT onProfile(float distance);
+// Centered between the lines
+PhaseLUT offProfile(float distance);
+
+// Fused per frame update of the on/off accumulators:
+//   on_result  += on_profile(phase)  * (frame - blacklevel) * weight
+//   off_result += off_profile(phase) * (frame - blacklevel) * weight
+// The masks are looked up from the profiles at the line phase of each pixel, so no
+// mask images are needed. Reads every input once and writes the accumulators in place.
+// With threshold > 0 only the bands around the lines where a profile exceeds the threshold
+// are visited, the rest of the row is skipped. Trades precision for speed.
+// The frame can be 8 or 16 bit unsigned or float and is widened on the fly, the accumulators
+// have to be CV_32FC1. All images have to be of the same size.
+void accumulateOnOff(const cv::Mat & frame, float blacklevel, float weight,
+		const LineGeometry & lines, const PhaseLUT & on_profile, const PhaseLUT & off_profile,
+		cv::Mat & on_result, cv::Mat & off_result, float threshold = 0);
+
+// Same on a raw frame that is calibrated on the fly, (frame - blacklevel) * gain takes the place of
+// frame - blacklevel. Nothing but the accumulators is written, there is no calibrated copy of the frame.
+void accumulateOnOff(const cv::Mat & frame, float blacklevel, float weight, const FrameGain & gain,
+		const LineGeometry & lines, const PhaseLUT & on_profile, const PhaseLUT & off_profile,
+		cv::Mat & on_result, cv::Mat & off_result, float threshold = 0);
+
+// result += (frame - blacklevel) * weight
+void accumulateWeighted(const cv::Mat & frame, float blacklevel, float weight, cv::Mat & result);
+
+// Lock-in against the scan, first temporal harmonic at scan_phase (in line distances):
+//   cos_result += (frame - blacklevel) * weight * cos(2 pi scan_phase)
+//   sin_result += (frame - blacklevel) * weight * sin(2 pi scan_phase)
+// The factors are per frame constants, there are no masks.
+void accumulateLockIn(const cv::Mat & frame, float blacklevel, float weight, double scan_phase, cv::Mat & cos_result, cv::Mat & sin_result);
+
+// Keeps the k smallest and the k largest values of (frame - blacklevel) * weight of every pixel over
+// all frames so far, k being the number of planes. low is sorted smallest first and has to start at +inf,
+// high largest first and has to start at -inf. Each value is inserted with a branchless min/max exchange
+// per plane, which vectorizes over the pixels of a row. The frame is read once for both.
+void accumulateOrderStatistics(const cv::Mat & frame, float blacklevel, float weight, const std::vector<cv::Mat> & low, const std::vector<cv::Mat> & high);
+// Merges the statistics other_low and other_high of other frames into low and high
+void mergeOrderStatistics(const std::vector<cv::Mat> & other_low, const std::vector<cv::Mat> & other_high, const std::vector<cv::Mat> & low, const std::vector<cv::Mat> & high);
+
+// Streaming estimate of the p and 1 - p quantiles of (frame - blacklevel) * weight of every pixel, with the
+// extended P-square algorithm (Jain and Chlamtac, Raatikainen): 7 markers per pixel at the quantiles
+// 0, p/2, p, 1/2, 1 - p, 1 - p/2 and 1 are moved toward their desired ranks with a parabolic fit as frames arrive.
+// Memory and work per frame do not depend on p or the number of frames. Up to 7 frames the result is exact.
+// Every pixel has to get its frames in order, sketches of different workers can not be merged.
+class QuantileSketch {
+public:
+	QuantileSketch(float p);
+
+	// Starts over for frames of size
+	void reset(cv::Size size);
+	// Adds frame n, n frames having been added before, to the pixels in roi. frame_roi is the part of the frame in roi.
+	void add(const cv::Mat & frame_roi, cv::Rect roi, int n, float blacklevel, float weight);
+	// Estimates of the p and 1 - p quantiles after num_frames frames
+	void quantiles(int num_frames, cv::Mat & low, cv::Mat & high) const;
+
+private:
+	static constexpr int num_markers = 7;
+	float p;
+	std::array<float, num_markers> targets; // quantile of each marker
+	// Pixel major, per pixel the heights of all markers, then the (1 based) ranks of the inner markers.
+	// The outer markers always sit at rank 1 and at the number of frames.
+	Stack markers;
+};
+
+// Pixel reassignment: every pixel where profile is above threshold moves toward the center of its line
+// by fraction of its distance to it, along the line normal. Only depends on the line geometry of a frame,
+// so it is built once per frame and reused for every file with the same geometry.
+struct ReassignmentTable {
+	struct Entry {
+		int32_t source; // pixel index in the frame
+		int32_t target; // pixel index in the result
+		float weight; // profile at the source pixel
+	};
+	std::vector<Entry> entries;
+	cv::Size size;
+
+	ReassignmentTable() = default;
+	ReassignmentTable(const LineGeometry & lines, cv::Size size, const PhaseLUT & profile, float threshold, float fraction);
+
+	bool empty() const {
+		return entries.empty();
+	}
+};
+
+// result[target] += weight of the entry * (frame[source] - blacklevel) * weight, for every entry of table.
+// Targets of different entries can coincide, so parallel callers need their own results.
+// frame and result have to be continuous and of the size of the table.
+void accumulateReassigned(const cv::Mat & frame, float blacklevel, float weight, const ReassignmentTable & table, cv::Mat & result);
+
+// Splits an image into square tiles of tile_size, the tiles at the right and bottom border may be smaller
+std::vector<cv::Rect> makeTiles(cv::Size size, int tile_size);
+
+// Decodes the frames of a file in batches and folds them into partials per worker.
+// By default a batch has one frame per worker and frame i is always accumulated by worker i % num_workers
+// into its own partials. These are reduced in worker order at the end, so the result is the same for a
+// given number of threads.
+// With tile_size > 0 the workers split the image into tiles instead and every tile runs through all frames
+// of the batch while its accumulators stay in cache. There is a single worker, each pixel sums its frames
+// in order and the result does not depend on the number of threads at all.
+class BatchAccumulator {
+public:
+	struct Callbacks {
+		// Called once with the size of the first frame, before anything is allocated. Returning false stops the run.
+		std::function<bool(cv::Size frame_size)> start;
+		// Called for every frame before it is accumulated, the frames of a batch in parallel
+		std::function<void(const cv::Mat & image, int i)> prepare;
+		// Accumulates the part of frame i inside roi into the partials of worker w
+		std::function<void(const cv::Mat & image, int i, cv::Rect roi, int w)> accumulate;
+		// Called after every batch on the calling thread with the frames of the batch, optional
+		std::function<void(const std::vector<cv::Mat> & images, int first_frame, int batch_size)> batch_done;
+	};
+
+	BatchAccumulator(int threads, int tile_size = 0, int batch_frames = 16);
+
+	// Reads up to num_frames pages of the current file of reader. Pages are handed to the callbacks in
+	// the depth they were decoded in, only depths the kernels can not widen on the fly are converted to float.
+	// Before the first frame planes partials per worker are set up for on and off, filled with on_initial and
+	// off_initial. Returns the number of frames read, or -1 if start failed or the pages differ in size.
+	int run(PrefetchReader & reader, int num_frames, int planes, const Callbacks & callbacks, float on_initial = 0, float off_initial = 0);
+
+	// Of the last run
+	int numWorkers() const {
+		return num_workers;
+	}
+	// Partials of worker w are the planes frames starting at w * planes
+	const Stack & onPartials() const {
+		return on_partial;
+	}
+	const Stack & offPartials() const {
+		return off_partial;
+	}
+	// Sums of the first plane of every worker, in worker order
+	void sum(cv::Mat & on_result, cv::Mat & off_result) const;
+
+private:
+	int threads;
+	int tile_size;
+	int batch_frames;
+	int num_workers = 1;
+	int planes = 0;
+	Stack on_partial;
+	Stack off_partial;
+	std::vector<cv::Mat> pages;
+	// Kernel input for each page of the batch, usually the page itself
+	std::vector<cv::Mat> images;
+	std::vector<cv::Mat> converted_pages;
+};
@@ -6,6 +6,10 @@
 #include "clipp.hpp"
 #include <opencv2/opencv.hpp>
 #include "calibration.h"
+#include "frames.h"
+#include "tiff_writer.h"
+#include "pixel_types.h"
+#include <memory>
 
 using namespace clipp;
 
@@ -17,6 +21,7 @@ int main(int argc, char** argv) {
 	float blacklevel;
 	bool multiply_directions = false;
 	bool minimum_directions = false;
+	bool cyclic = false;
 
 	auto cli = (
 		option("-h", "--help").set(help) % "Show documentation." |
@@ -24,7 +29,8 @@ int main(int argc, char** argv) {
 			required("-b") & value("blacklevel", blacklevel),
 			required("-i") & value("images", images_filename),
 			required("-c") & value("calibration", calibration_filename),
-			option("-o") & value("output", output_filename),
+			option("-o") & value("output", output_filename) % "Multi page TIFF output",
+			option("--cycle").set(cyclic) % "Apply the calibration cyclically to all frames instead of stopping after one scan cycle",
 			(option("--mult").set(multiply_directions) | option("--min").set(minimum_directions))
 		)
 	);
@@ -44,46 +50,123 @@ int main(int argc, char** argv) {
 	}
 
 
-	// Load input images
-	std::vector<cv::Mat> in_images;
-	{
-		std::vector<cv::Mat> read_images;
-		if (!cv::imreadmulti(images_filename, read_images, cv::IMREAD_GRAYSCALE | cv::IMREAD_ANYDEPTH)) {
-			std::cerr << "Could not read images" << std::endl;
+	// Calibration cycle: position k of a scan cycle uses step cycle[k].second of calibration cycle[k].first,
+	// directions one after another. Full size factor images are only used for image calibration files.
+	std::vector<std::pair<const Calibration *, int>> cycle;
+	std::vector<Calibration> calibrations;
+	Stack calibration_factors;
+	if (isCalibrationFile(calibration_filename)) {
+		calibrations = readCalibrations(calibration_filename);
+		if (calibrations.empty()) {
+			std::cerr << "Could not read calibration" << std::endl;
 			return 2;
 		}
-		for (auto im : read_images) {
-			cv::Mat fim;
-			im.convertTo(fim, CV_32FC1);
-			in_images.push_back(fim);
+		for (const Calibration & calibration : calibrations) {
+			for (int step = 0; step < calibration.size(); ++step) {
+				cycle.push_back(std::make_pair(&calibration, step));
+			}
 		}
-	}
-
-	//Load calibration images
-	std::vector<cv::Mat> calibration_factors;
-	{
-		if (!cv::imreadmulti(calibration_filename, calibration_factors, cv::IMREAD_GRAYSCALE | cv::IMREAD_ANYDEPTH)) {
+	} else {
+		calibration_factors = Stack::read(calibration_filename);
+		if (calibration_factors.empty()) {
 			std::cerr << "Could not read images" << std::endl;
 			return 2;
 		}
 	}
+	int cycle_length = calibration_factors.empty() ? cycle.size() : calibration_factors.size();
 
-	cv::Size image_size = in_images.at(0).size();
+	bool combine_directions = multiply_directions || minimum_directions;
+	CombineOp combine_op = multiply_directions ? CombineOp::Multiply : CombineOp::Minimum;
+	if (combine_directions) {
+		if (calibrations.empty()) {
+			std::cerr << "--mult and --min need a calibration file with scan directions" << std::endl;
+			return 1;
+		}
+		for (const Calibration & calibration : calibrations) {
+			if (calibration.size() != calibrations[0].size()) {
+				std::cerr << "--mult and --min need the same number of steps in every direction" << std::endl;
+				return 1;
+			}
+		}
+	}
 
-	std::vector<cv::Mat> calibrated_images;
-	for (int i = 0; i < calibration_factors.size(); ++i) {
-		cv::Mat image = in_images.at(i) - blacklevel;
-		auto & cal = calibration_factors.at(i);
-		cv::Mat calibrated;
-		cv::multiply(image, cal, calibrated);
-		calibrated_images.push_back(calibrated);
+	auto calibrate_frame = [&](const cv::Mat & frame, int position, cv::Mat & calibrated) {
+		if (calibration_factors.empty()) {
+			auto [calibration, step] = cycle[position];
+			calibration->apply(frame, step, blacklevel, calibrated);
+		} else {
+			applyCalibration(frame, blacklevel, calibration_factors[position], calibrated);
+		}
+	};
+
+	// Pages are decoded ahead on a reader thread, calibrated one at a time and appended to the output,
+	// so memory does not depend on the length of the recording
+	PrefetchReader reader({images_filename}, 4);
+	if (!reader.nextFile()) {
+		std::cerr << "Could not read images" << std::endl;
+		return 2;
 	}
 
+	std::unique_ptr<TiffWriter> writer;
 	if (output_filename != "") {
-		cv::imwrite(output_filename, calibrated_images);
+		writer = std::make_unique<TiffWriter>(output_filename);
+		if (!writer->isOpened()) {
+			std::cerr << "Could not open " << output_filename << std::endl;
+			return 2;
+		}
 	}
 
+	auto write_frame = [&](const cv::Mat & frame) {
+		if (writer && !writer->write(frame)) {
+			std::cerr << "Could not write " << output_filename << std::endl;
+			return false;
+		}
+		return true;
+	};
+
+	cv::Mat page;
+	cv::Mat calibrated;
+	// Combining directions: step s of every direction is folded into combined[s] as it arrives,
+	// the first direction initializes it and the last one writes it.
+	// Only one direction worth of frames is held instead of every calibrated direction.
+	Stack combined;
+	for (int k = 0; (cyclic || k < cycle_length) && reader.read(page); ++k) {
+		if (!calibration_factors.empty() && page.size() != calibration_factors.frameSize()) {
+			std::cerr << "Calibration and images differ in size" << std::endl;
+			return 2;
+		}
+		// The calibration kernels widen 8 and 16 bit unsigned and float pages on the fly, other depths are converted
+		if (!isNativeDepth(page.depth())) {
+			page.convertTo(page, CV_32FC1);
+		}
+		int position = k % cycle_length;
+		if (!combine_directions) {
+			calibrate_frame(page, position, calibrated);
+			if (!write_frame(calibrated)) {
+				return 2;
+			}
+			continue;
+		}
 
+		int steps = calibrations[0].size();
+		int direction = position / steps;
+		int step = position % steps;
+		if (combined.empty()) {
+			combined = Stack(steps, page.size(), CV_32FC1);
+		} else if (page.size() != combined.frameSize()) {
+			std::cerr << "Images differ in size" << std::endl;
+			return 2;
+		}
+		cv::Mat result = combined[step];
+		if (direction == 0) {
+			calibrations[direction].apply(page, step, blacklevel, result);
+		} else {
+			calibrations[direction].combine(page, step, blacklevel, result, combine_op);
+		}
+		if (direction == int(calibrations.size()) - 1 && !write_frame(result)) {
+			return 2;
+		}
+	}
 
 	return 0;
 
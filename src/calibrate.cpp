@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <vector>
 #include <array>
+#include <sstream>
 #include "clipp.hpp"
 #include <opencv2/opencv.hpp>
 #include "calibration.h"
@@ -43,28 +44,14 @@ std::array<cv::Point, 3> clickPoints(cv::Mat image) {
 	return clicked_points_arr;
 }
 
-std::vector<cv::Point> parsePoints(std::string input) {
-	std::vector<cv::Point> points;
-	std::istringstream iss;
-	iss.str(input);
-	for (std::string line; std::getline(iss, line, ';');) {
-		std::vector<int> vals;
-		std::istringstream iss2;
-		iss2.str(line);
-		for (std::string val; std::getline(iss2, val, ',');) {
-			int p = std::stoi(val);
-			vals.push_back(p);
-		}
-		points.push_back(cv::Point(vals.at(0), vals.at(1)));
-	}
-	return points;
-}
-
 int main(int argc, char** argv) {
 	bool help = false;
 	std::string filename;
 	std::string points;
 	std::string output_filename;
+	std::string merge_filename;
+	int mip_frames = 0;
+	bool track = false;
 	int num_images;
 	int num_directions;
 	float blacklevel;
@@ -77,7 +64,10 @@ int main(int argc, char** argv) {
 			required("-d") & value("num_directions", num_directions),
 			required("-b") & value("blacklevel", blacklevel),
 			value("filename", filename),
-			option("-o") & value("output", output_filename)
+			option("-o") & value("output", output_filename),
+			option("--mip") & value("frames", mip_frames) % "Show the calibration and a maximum intensity projection of this many calibrated frames per direction to check it",
+			option("--track").set(track) % "Measure where the lines are in every frame instead of assuming equal steps",
+			option("--merge") & value("calibration", merge_filename) % "Merge this acquisition into an existing calibration file. Its lines are used, no points needed."
 		)
 	);
 
@@ -97,30 +87,45 @@ int main(int argc, char** argv) {
 
 
 	// Load input images
-	std::vector<cv::Mat> in_images;
-	{
-		std::vector<cv::Mat> read_images;
-		if (!cv::imreadmulti(filename, read_images, cv::IMREAD_GRAYSCALE | cv::IMREAD_ANYDEPTH)) {
-			std::cerr << "Could not read images" << std::endl;
+	Stack in_images = Stack::read(filename, -1);
+	if (in_images.empty()) {
+		std::cerr << "Could not read images" << std::endl;
+		return 2;
+	}
+	if (num_directions * num_images > in_images.size()) {
+		std::cerr << "Too few images in input file" << std::endl;
+		return 2;
+	}
+
+	cv::Size image_size = in_images.frameSize();
+
+	// Running estimate this acquisition is added to
+	std::vector<Calibration> previous_calibrations;
+	if (merge_filename != "") {
+		previous_calibrations = readCalibrations(merge_filename);
+		if (previous_calibrations.empty()) {
+			std::cerr << "Could not read calibration" << std::endl;
 			return 2;
 		}
-		if (num_directions * num_images > read_images.size()) {
-			std::cerr << "Too few images in input file" << std::endl;
+		if (int(previous_calibrations.size()) != num_directions) {
+			std::cerr << merge_filename << " has " << previous_calibrations.size() << " directions" << std::endl;
+			return 1;
 		}
-		for (auto im : read_images) {
-			cv::Mat fim;
-			im.convertTo(fim, CV_32FC1);
-			in_images.push_back(fim);
+		for (const Calibration & calibration : previous_calibrations) {
+			if (!calibration.mergeable() || calibration.size() != num_images) {
+				std::cerr << merge_filename << " can not be merged with " << num_images << " images per direction" << std::endl;
+				return 1;
+			}
 		}
 	}
 
-	cv::Size image_size = in_images.at(0).size();
-
 	//Select or parse line defining points
 	std::vector<std::array<cv::Point, 3>> line_defining_points(num_directions);
-	if (points == "") {
+	if (!previous_calibrations.empty()) {
+		// Lines are taken from the calibration merged into
+	} else if (points == "") {
 		for (int direction_idx = 0; direction_idx < num_directions; ++direction_idx) {
-			auto clicked_points = clickPoints(in_images.at(direction_idx * num_images));
+			auto clicked_points = clickPoints(in_images[direction_idx * num_images]);
 			line_defining_points.at(direction_idx) = clicked_points;
 			for (int i = 0; i < 3; ++i) {
 				std::cout << clicked_points.at(i).x << "," << clicked_points.at(i).y << ";";
@@ -138,40 +143,64 @@ int main(int argc, char** argv) {
 		}
 	}
 
-	std::vector<cv::Mat> all_calibration_factors;
+	std::vector<Stack> direction_images;
+	std::vector<Lines> direction_lines;
 	for (int direction_idx = 0; direction_idx < num_directions; ++direction_idx) {
-		std::span images{in_images.begin() + direction_idx * num_images, in_images.begin() + (direction_idx + 1) * num_images};
-
-		std::array<cv::Point, 3> points = line_defining_points.at(direction_idx);
-		Lines lines = linesFromPoints(points, 10);
-
-		std::vector<cv::Mat> calibration_factors = calculateCalibrationFactors(images, lines, blacklevel);
+		direction_images.push_back(in_images.range(direction_idx * num_images, num_images));
+		if (previous_calibrations.empty()) {
+			direction_lines.push_back(linesFromPoints(line_defining_points.at(direction_idx), 10));
+		} else {
+			direction_lines.push_back(previous_calibrations.at(direction_idx).lines);
+		}
+	}
 
-		cv::imshow("Cal", calibration_factors.at(0));
+	std::vector<Calibration> calibrations = calculateCalibrations(direction_images, direction_lines, blacklevel, track);
+	if (!previous_calibrations.empty()) {
+		for (int direction_idx = 0; direction_idx < num_directions; ++direction_idx) {
+			previous_calibrations.at(direction_idx).merge(calibrations.at(direction_idx));
+		}
+		calibrations = previous_calibrations;
+	}
 
-		// Test calibration
-		cv::Mat mip(image_size, CV_32FC1);
-		{
-			for (int i = 0; i < 60; ++i) {
-				cv::Mat frame = images[i] - blacklevel;
-				cv::Mat calibrated_frame;
-				cv::multiply(frame, calibration_factors.at(i), calibrated_frame);
-				mip = cv::max(calibrated_frame, mip);
+	// Test calibration: maximum intensity projection of the first mip_frames calibrated frames,
+	// reduced in place into one frame per direction
+	if (mip_frames > 0) {
+		for (int direction_idx = 0; direction_idx < num_directions; ++direction_idx) {
+			const Calibration & calibration = calibrations.at(direction_idx);
+			const Stack & images = direction_images.at(direction_idx);
+			cv::Mat mip;
+			calibration.apply(images[0], 0, blacklevel, mip);
+			for (int i = 1; i < std::min(mip_frames, num_images); ++i) {
+				calibration.combine(images[i], i, blacklevel, mip, CombineOp::Maximum);
 			}
+			cv::imshow("Cal", calibration.factors(0, image_size));
+			std::stringstream ss;
+			ss << direction_idx << "MIP";
+			cv::imshow(ss.str().c_str(), mip / 10.f);
 		}
-		std::stringstream ss;
-		ss << direction_idx << "MIP";
-		cv::imshow(ss.str().c_str(), mip / 10.f);
-
-		std::copy(calibration_factors.begin(), calibration_factors.end(), std::back_inserter(all_calibration_factors));
 	}
 
 	if (output_filename != "") {
-		cv::imwrite(output_filename, all_calibration_factors);
+		if (isCalibrationFile(output_filename)) {
+			if (!writeCalibrations(output_filename, calibrations)) {
+				std::cerr << "Could not write " << output_filename << std::endl;
+				return 2;
+			}
+		} else {
+			// Full size factor image for every frame
+			Stack all_calibration_factors(num_directions * num_images, image_size, CV_32FC1);
+			for (int direction_idx = 0; direction_idx < num_directions; ++direction_idx) {
+				cv::Mat direction_factors = all_calibration_factors.range(direction_idx * num_images, num_images).frameMajor();
+				calculateCalibrationFactors(calibrations.at(direction_idx), image_size).frameMajor().copyTo(direction_factors);
+			}
+			all_calibration_factors.write(output_filename);
+		}
 	}
 
-	while (cv::waitKey(1) != 'q') {
+	if (mip_frames > 0) {
+		while (cv::waitKey(1) != 'q') {
 
+		}
 	}
 
 
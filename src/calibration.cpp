@@ -1,113 +1,406 @@
 #include "calibration.h"
+#include "pixel_types.h"
 #include <stdexcept>
-#include <map>
+#include <array>
+#include <algorithm>
 #include <stdint.h>
+#include <type_traits>
 #include <iostream>
+#include <filesystem>
 #include <opencv2/opencv.hpp>
 
-int8_t lineNumAtPoint(Lines lines, cv::Point point) {
-    // rotate coords by orientation
-	float x = point.x * std::cos(lines.orientation) - point.y * std::sin(lines.orientation);
-
-	// now calculate line num as is lines were vertical
-	return int(x - lines.offset) / lines.distance;
-}
-
-cv::Mat lineNumMask(Lines lines, cv::Size size) {
-	cv::Mat mask(size, CV_8SC1);
-	for (int y = 0; y < size.height; ++y) {
-		for (int x = 0; x < size.width; ++x) {
-			int8_t index = lineNumAtPoint(lines, cv::Point(x, y));
-			mask.at<int8_t>(y, x) = index;
-		}
-	}
-	return mask;
-}
-
-Lines offsetLines(Lines lines, int frame, int total_frames, int shift_dir = 1) {
+Lines offsetLines(Lines lines, int frame, int total_frames, int shift_dir) {
 	float offset_per_step = lines.distance / total_frames;
 	lines.offset += frame * offset_per_step * shift_dir;
 	return lines;
 }
 
-std::vector<cv::Mat> calculateCalibrationFactors(std::span<cv::Mat> in_images, Lines lines, float blacklevel) {
+std::vector<Calibration> calculateCalibrations(const std::vector<Stack> & in_images, const std::vector<Lines> & lines, float blacklevel, bool track_phase) {
+	CV_Assert(in_images.size() == lines.size());
 	struct Elem {
-		Elem()
-			: sum(0), num_elements(0) {
-			}
-		float sum;
-		float num_elements;
+		double sum = 0;
+		double num_elements = 0;
 	};
+	using LineHistogram = std::array<Elem, num_line_bins>;
+
+	int num_directions = in_images.size();
+	std::vector<Calibration> calibrations(num_directions);
+	int max_steps = 0;
+	for (int d = 0; d < num_directions; ++d) {
+		calibrations[d].lines = lines[d];
+		max_steps = std::max(max_steps, in_images[d].size());
+	}
 
-	//Per line mean over all frames
-	std::map<int, Elem> mean_intensities; //sum, num_elements
-	//Per frame mean
-	std::vector<float> frame_means;
-
-	int num_steps = in_images.size();
-	cv::Size image_size = in_images[0].size();
-
-	//Calculate mean of each frame and of each line
-	for (int i = 0; i < num_steps; ++i) {
-		cv::Mat frame = in_images[i] - blacklevel;
-		Lines offset_lines = offsetLines(lines, i, num_steps);
-		cv::Mat mask = lineNumMask(offset_lines, in_images[0].size());
-
-		//Calculate mean of frame (only in the center of the image)
-		cv::Rect mean_roi = cv::Rect(cv::Point(image_size) / 2 - cv::Point(200, 200), cv::Size(400, 400));
-		//float frame_mean = cv::mean(frame(mean_roi))[0];
-		//Calculate mean only of bright pixels (part of the lines)
-		cv::Mat mean_mask;
-		cv::Mat t = (frame > 5.f);
-		t.convertTo(mean_mask, CV_32FC1);
-		cv::Mat masked_frame;
-		cv::multiply(frame, mean_mask, masked_frame);
-		float frame_mean = cv::sum(masked_frame(mean_roi))[0] / cv::sum(mean_mask(mean_roi))[0];
-		frame_means.push_back(frame_mean);
-
-		for (int y = 0; y < image_size.height; ++y) {
-			for (int x = 0; x < image_size.width; ++x) {
-				float value = frame.at<float>(y, x);
-				int8_t mask_value = mask.at<int8_t>(y, x);
-				if (value > 5) {
-					// calculate mean as if frames were normalized
-					mean_intensities[mask_value].sum += value / frame_mean;
-					mean_intensities[mask_value].num_elements += 1;
+	//Every pixel is read once per frame: the pass sums the bright pixels of the roi for the frame mean and
+	//of each line for the line histogram at the same time. The line sums are divided by the frame mean once
+	//the frame is done, as if the frames had been normalized, and added to mean_intensities.
+	//Rows are split into fixed stripes with one partial sum each, merged in stripe order,
+	//so the result does not depend on how the stripes are scheduled.
+	//The directions are independent, step i of all of them is processed in the same parallel pass.
+	//Besides the input only num_directions * num_stripes histograms of a few kilobytes are needed.
+	struct StripeSums {
+		LineHistogram histogram;
+		double roi_sum = 0;
+		double roi_num_elements = 0;
+	};
+	int num_stripes = std::max(1, cv::getNumThreads());
+	std::vector<StripeSums> stripe_sums(num_directions * num_stripes);
+	std::vector<LineHistogram> mean_intensities(num_directions);
+
+	//Frame means are taken only in the center of the image and only of bright pixels (part of the lines)
+	auto meanRoi = [](cv::Size image_size) {
+		return cv::Rect(cv::Point(image_size) / 2 - cv::Point(200, 200), cv::Size(400, 400)) & cv::Rect(cv::Point(0, 0), image_size);
+	};
+
+	for (int i = 0; i < max_steps; ++i) {
+		//Nominal lines of step i. With track_phase they are moved to where the lines are measured in the roi,
+		//the few percent of the frame this reads are cheap against the full frame pass below.
+		//Calibration lines sit half a line distance off, so the lines are centered in their line number bins.
+		std::vector<LineGeometry> geometries;
+		for (int d = 0; d < num_directions; ++d) {
+			geometries.push_back(LineGeometry(offsetLines(lines[d], i, std::max(in_images[d].size(), 1))));
+		}
+		std::vector<double> shifts(num_directions, 0);
+		if (track_phase) {
+			cv::parallel_for_(cv::Range(0, num_directions), [&](const cv::Range & range) {
+				for (int d = range.start; d < range.end; ++d) {
+					if (i >= in_images[d].size()) {
+						continue;
+					}
+					cv::Mat frame = in_images[d][i];
+					cv::Rect mean_roi = meanRoi(frame.size());
+					float measured = measureLinePhase(frame(mean_roi), blacklevel, geometries[d].cropped(mean_roi.tl()));
+					shifts[d] = wrapPhase(measured - 0.5);
+					geometries[d] = geometries[d].shifted(shifts[d]);
+				}
+			}, num_directions);
+		}
+
+		cv::parallel_for_(cv::Range(0, num_directions * num_stripes), [&](const cv::Range & range) {
+			for (int task = range.start; task < range.end; ++task) {
+				int d = task / num_stripes;
+				int stripe = task % num_stripes;
+				int num_steps = in_images[d].size();
+				if (i >= num_steps) {
+					continue;
+				}
+				cv::Mat frame = in_images[d][i];
+				cv::Size image_size = frame.size();
+				const LineGeometry & geometry = geometries[d];
+				cv::Rect mean_roi = meanRoi(image_size);
+				std::vector<float> phase(image_size.width);
+
+				StripeSums & sums = stripe_sums[task];
+				sums = StripeSums();
+				int y_begin = image_size.height * stripe / num_stripes;
+				int y_end = image_size.height * (stripe + 1) / num_stripes;
+				// Input pixels are widened on the fly, no float copy of the frame
+				dispatchNativeDepth(frame.depth(), [&]<typename T>(const T *) {
+					// Pixels [x_begin, x_end) of a row, the roi sum is only compiled into the roi part
+					auto add_pixels = [&]<bool in_roi>(const T * frame_row, int x_begin, int x_end, std::bool_constant<in_roi>) {
+						for (int x = x_begin; x < x_end; ++x) {
+							float value = frame_row[x] - blacklevel;
+							if (value > 5) {
+								Elem & elem = sums.histogram[lineIndex(phase[x]) + line_index_offset];
+								elem.sum += value;
+								elem.num_elements += 1;
+								if constexpr (in_roi) {
+									sums.roi_sum += value;
+									sums.roi_num_elements += 1;
+								}
+							}
+						}
+					};
+					for (int y = y_begin; y < y_end; ++y) {
+						geometry.phaseRow(y, phase.data(), image_size.width);
+						const T * frame_row = frame.ptr<T>(y);
+						if (y >= mean_roi.y && y < mean_roi.br().y) {
+							add_pixels(frame_row, 0, mean_roi.x, std::false_type());
+							add_pixels(frame_row, mean_roi.x, mean_roi.br().x, std::true_type());
+							add_pixels(frame_row, mean_roi.br().x, image_size.width, std::false_type());
+						} else {
+							add_pixels(frame_row, 0, image_size.width, std::false_type());
+						}
+					}
+				});
+			}
+		}, num_directions * num_stripes);
+
+		for (int d = 0; d < num_directions; ++d) {
+			if (i >= in_images[d].size()) {
+				continue;
+			}
+			const StripeSums * direction_sums = &stripe_sums[d * num_stripes];
+			double roi_sum = 0;
+			double roi_num_elements = 0;
+			for (int stripe = 0; stripe < num_stripes; ++stripe) {
+				roi_sum += direction_sums[stripe].roi_sum;
+				roi_num_elements += direction_sums[stripe].roi_num_elements;
+			}
+			float frame_mean = roi_sum / roi_num_elements;
+			calibrations[d].frame_sums.push_back(roi_sum);
+			calibrations[d].frame_num_elements.push_back(roi_num_elements);
+			if (track_phase) {
+				// The factors of the step are applied on the lines its histogram was taken on
+				calibrations[d].frame_shifts.push_back(shifts[d]);
+			}
+
+			// calculate mean as if frames were normalized
+			for (int stripe = 0; stripe < num_stripes; ++stripe) {
+				for (int bin = 0; bin < num_line_bins; ++bin) {
+					mean_intensities[d][bin].sum += direction_sums[stripe].histogram[bin].sum / frame_mean;
+					mean_intensities[d][bin].num_elements += direction_sums[stripe].histogram[bin].num_elements;
 				}
 			}
 		}
 	}
 
-	std::map<int, float> mean_intensity;
-	auto calc_mean = [] (auto & pair)
-	{
-		return std::make_pair(pair.first, pair.second.sum / pair.second.num_elements);
-	};
-	std::transform(mean_intensities.begin(), mean_intensities.end(), std::inserter(mean_intensity, mean_intensity.end()), calc_mean);
+	for (int d = 0; d < num_directions; ++d) {
+		Calibration & calibration = calibrations[d];
+		for (const Elem & elem : mean_intensities[d]) {
+			calibration.line_sums.push_back(elem.sum);
+			calibration.line_num_elements.push_back(elem.num_elements);
+		}
+		calibration.updateMeans();
+
+		for (auto const & value : calibration.frame_means)
+			std::cout << value << std::endl;
+		for (int bin = 0; bin < num_line_bins; ++bin)
+			if (mean_intensities[d][bin].num_elements > 0)
+				std::cout << bin - line_index_offset << ", " << calibration.line_means[bin] << std::endl;
+	}
 
-	for (auto const & value : frame_means)
-		std::cout << value << std::endl;
-	for (auto const & [key, value] : mean_intensity)
-		std::cout << key << ", " << value << std::endl;
+	return calibrations;
+}
 
+Calibration calculateCalibration(const Stack & in_images, Lines lines, float blacklevel) {
+	return calculateCalibrations({in_images}, {lines}, blacklevel).at(0);
+}
 
-	std::vector<cv::Mat> calibration_factors(num_steps);
-	//Now generate calibration factors for each frame
-	for(int i = 0; i < num_steps; ++i) {
-		cv::Mat & calibration_fac = calibration_factors[i];
-		calibration_fac.create(image_size, CV_32FC1);
+void Calibration::updateMeans() {
+	frame_means.resize(frame_sums.size());
+	for (size_t i = 0; i < frame_sums.size(); ++i) {
+		frame_means[i] = frame_sums[i] / frame_num_elements[i];
+	}
+	//Lines without any bright pixel get a mean of 0
+	line_means.resize(num_line_bins);
+	for (int bin = 0; bin < num_line_bins; ++bin) {
+		line_means[bin] = line_num_elements[bin] > 0 ? line_sums[bin] / line_num_elements[bin] : 0;
+	}
+}
 
-		Lines offset_lines = offsetLines(lines, i, num_steps);
-		cv::Mat mask = lineNumMask(offset_lines, image_size);
+void Calibration::merge(const Calibration & other) {
+	CV_Assert(mergeable() && other.mergeable() && other.size() == size());
+	if (!frame_shifts.empty() || !other.frame_shifts.empty()) {
+		// Untracked frames sit at the equal steps. Averaged on the circle, shifts can wrap around.
+		std::vector<double> shifts(size());
+		for (int i = 0; i < size(); ++i) {
+			double shift = frame_shifts.empty() ? 0 : frame_shifts[i];
+			double other_shift = other.frame_shifts.empty() ? 0 : other.frame_shifts[i];
+			double re = frame_num_elements[i] * std::cos(2 * M_PI * shift) + other.frame_num_elements[i] * std::cos(2 * M_PI * other_shift);
+			double im = frame_num_elements[i] * std::sin(2 * M_PI * shift) + other.frame_num_elements[i] * std::sin(2 * M_PI * other_shift);
+			shifts[i] = wrapPhase(std::atan2(im, re) / (2 * M_PI));
+		}
+		frame_shifts = shifts;
+	}
+	for (size_t i = 0; i < frame_sums.size(); ++i) {
+		frame_sums[i] += other.frame_sums[i];
+		frame_num_elements[i] += other.frame_num_elements[i];
+	}
+	for (int bin = 0; bin < num_line_bins; ++bin) {
+		line_sums[bin] += other.line_sums[bin];
+		line_num_elements[bin] += other.line_num_elements[bin];
+	}
+	updateMeans();
+}
 
-		for (int y = 0; y < image_size.height; ++y) {
-			for (int x = 0; x < image_size.width; ++x) {
-				int8_t mask_value = mask.at<int8_t>(y, x);
-				calibration_fac.at<float>(y, x) = 1.0 / frame_means[i] / mean_intensity[mask_value];
+LineGeometry Calibration::frameLines(int i) const {
+	LineGeometry geometry(offsetLines(lines, i, size()));
+	if (!frame_shifts.empty()) {
+		geometry = geometry.shifted(frame_shifts[i]);
+	}
+	return geometry;
+}
+
+FrameGain Calibration::gain(int i) const {
+	FrameGain gain{frameLines(i), {}};
+	for (int bin = 0; bin < num_line_bins; ++bin) {
+		gain.factors[bin] = 1.0 / frame_means[i] / line_means[bin];
+	}
+	return gain;
+}
+
+double FrameGain::mean(const cv::Mat & frame, float blacklevel) const {
+	CV_Assert(frame.channels() == 1);
+	std::vector<float> gain_row(frame.cols);
+	double sum = 0;
+	dispatchNativeDepth(frame.depth(), [&]<typename T>(const T *) {
+		for (int y = 0; y < frame.rows; ++y) {
+			row(y, gain_row.data(), frame.cols);
+			const T * in = frame.ptr<T>(y);
+			float row_sum = 0;
+			for (int x = 0; x < frame.cols; ++x) {
+				row_sum += (in[x] - blacklevel) * gain_row[x];
 			}
+			sum += row_sum;
 		}
+	});
+	return sum / frame.total();
+}
+
+cv::Mat Calibration::factors(int i, cv::Size size) const {
+	cv::Mat calibration_fac(size, CV_32FC1);
+	FrameGain frame_gain = gain(i);
+	for (int y = 0; y < size.height; ++y) {
+		frame_gain.row(y, calibration_fac.ptr<float>(y), size.width);
+	}
+	return calibration_fac;
+}
+
+// Calibrates frame i row by row in parallel and hands every calibrated value to
+// op(output value, calibrated value), so reductions need no intermediate image
+template <typename Op>
+static void calibrateRows(const Calibration & calibration, const cv::Mat & frame, int i, float blacklevel, cv::Mat & result, Op op) {
+	CV_Assert(frame.channels() == 1);
+	CV_Assert(result.type() == CV_32FC1 && result.size() == frame.size());
+	FrameGain frame_gain = calibration.gain(i);
+	dispatchNativeDepth(frame.depth(), [&]<typename T>(const T *) {
+		cv::parallel_for_(cv::Range(0, frame.rows), [&](const cv::Range & rows) {
+			std::vector<float> gain_row(frame.cols);
+			for (int y = rows.start; y < rows.end; ++y) {
+				frame_gain.row(y, gain_row.data(), frame.cols);
+				const T * __restrict in = frame.ptr<T>(y);
+				float * __restrict out = result.ptr<float>(y);
+				for (int x = 0; x < frame.cols; ++x) {
+					op(out[x], (in[x] - blacklevel) * gain_row[x]);
+				}
+			}
+		});
+	});
+}
+
+void Calibration::apply(const cv::Mat & frame, int i, float blacklevel, cv::Mat & calibrated) const {
+	calibrated.create(frame.size(), CV_32FC1);
+	calibrateRows(*this, frame, i, blacklevel, calibrated, [](float & out, float value) { out = value; });
+}
+
+void Calibration::combine(const cv::Mat & frame, int i, float blacklevel, cv::Mat & combined, CombineOp combine_op) const {
+	switch (combine_op) {
+		case CombineOp::Maximum:
+			calibrateRows(*this, frame, i, blacklevel, combined, [](float & out, float value) { out = std::max(out, value); });
+			break;
+		case CombineOp::Multiply:
+			calibrateRows(*this, frame, i, blacklevel, combined, [](float & out, float value) { out *= value; });
+			break;
+		case CombineOp::Minimum:
+			calibrateRows(*this, frame, i, blacklevel, combined, [](float & out, float value) { out = std::min(out, value); });
+			break;
 	}
+}
 
+Stack calculateCalibrationFactors(const Calibration & calibration, cv::Size size) {
+	Stack calibration_factors(calibration.size(), size, CV_32FC1);
+	cv::parallel_for_(cv::Range(0, calibration.size()), [&](const cv::Range & range) {
+		for (int i = range.start; i < range.end; ++i) {
+			cv::Mat calibration_fac = calibration_factors[i];
+			calibration.factors(i, size).copyTo(calibration_fac);
+		}
+	});
 	return calibration_factors;
 }
 
+bool isCalibrationFile(std::string filename) {
+	std::filesystem::path path(filename);
+	if (path.extension() == ".gz") {
+		path = path.stem();
+	}
+	std::string extension = path.extension().string();
+	return extension == ".yml" || extension == ".yaml" || extension == ".xml" || extension == ".json";
+}
+
+bool writeCalibrations(std::string filename, const std::vector<Calibration> & calibrations) {
+	cv::FileStorage fs(filename, cv::FileStorage::WRITE);
+	if (!fs.isOpened()) {
+		return false;
+	}
+	fs << "directions" << "[";
+	for (const Calibration & calibration : calibrations) {
+		fs << "{";
+		fs << "orientation" << calibration.lines.orientation;
+		fs << "distance" << calibration.lines.distance;
+		fs << "offset" << calibration.lines.offset;
+		fs << "frame_means" << calibration.frame_means;
+		fs << "line_means" << calibration.line_means;
+		if (!calibration.frame_shifts.empty()) {
+			fs << "frame_shifts" << calibration.frame_shifts;
+		}
+		if (calibration.mergeable()) {
+			fs << "frame_sums" << calibration.frame_sums;
+			fs << "frame_num_elements" << calibration.frame_num_elements;
+			fs << "line_sums" << calibration.line_sums;
+			fs << "line_num_elements" << calibration.line_num_elements;
+		}
+		fs << "}";
+	}
+	fs << "]";
+	return true;
+}
+
+std::vector<Calibration> readCalibrations(std::string filename) {
+	std::vector<Calibration> calibrations;
+	try {
+		cv::FileStorage fs(filename, cv::FileStorage::READ);
+		if (!fs.isOpened()) {
+			return calibrations;
+		}
+		cv::FileNode directions = fs["directions"];
+		for (size_t i = 0; i < directions.size(); ++i) {
+			cv::FileNode node = directions[int(i)];
+			Calibration calibration;
+			node["orientation"] >> calibration.lines.orientation;
+			node["distance"] >> calibration.lines.distance;
+			node["offset"] >> calibration.lines.offset;
+			node["frame_means"] >> calibration.frame_means;
+			node["line_means"] >> calibration.line_means;
+			if (calibration.frame_means.empty() || calibration.line_means.size() != num_line_bins) {
+				return std::vector<Calibration>();
+			}
+			// Only written for tracked calibrations
+			node["frame_shifts"] >> calibration.frame_shifts;
+			if (!calibration.frame_shifts.empty() && calibration.frame_shifts.size() != calibration.frame_means.size()) {
+				return std::vector<Calibration>();
+			}
+			// Optional, only needed to merge further acquisitions
+			node["frame_sums"] >> calibration.frame_sums;
+			node["frame_num_elements"] >> calibration.frame_num_elements;
+			node["line_sums"] >> calibration.line_sums;
+			node["line_num_elements"] >> calibration.line_num_elements;
+			if (calibration.frame_sums.size() != calibration.frame_means.size() || calibration.frame_num_elements.size() != calibration.frame_means.size()
+					|| calibration.line_sums.size() != num_line_bins || calibration.line_num_elements.size() != num_line_bins) {
+				calibration.frame_sums.clear();
+				calibration.frame_num_elements.clear();
+				calibration.line_sums.clear();
+				calibration.line_num_elements.clear();
+			}
+			calibrations.push_back(calibration);
+		}
+	} catch (const cv::Exception & e) {
+		return std::vector<Calibration>();
+	}
+	return calibrations;
+}
+
+void applyCalibration(const cv::Mat & frame, float blacklevel, const cv::Mat & factors, cv::Mat & calibrated) {
+	CV_Assert(frame.channels() == 1 && factors.type() == CV_32FC1 && factors.size() == frame.size());
+	calibrated.create(frame.size(), CV_32FC1);
+	dispatchNativeDepth(frame.depth(), [&]<typename T>(const T *) {
+		for (int y = 0; y < frame.rows; ++y) {
+			const T * __restrict in = frame.ptr<T>(y);
+			const float * __restrict fac = factors.ptr<float>(y);
+			float * __restrict out = calibrated.ptr<float>(y);
+			for (int x = 0; x < frame.cols; ++x) {
+				out[x] = (in[x] - blacklevel) * fac[x];
+			}
+		}
+	});
+}
@@ -1,7 +1,112 @@
 #pragma once
 #include <opencv2/core/core.hpp>
-#include <span>
+#include <array>
+#include <stdint.h>
+#include <string>
+#include <vector>
 #include "lines.h"
+#include "stack.h"
 
-cv::Mat lineNumMask(Lines lines, cv::Size size);
-std::vector<cv::Mat> calculateCalibrationFactors(std::span<cv::Mat> in_images, Lines lines, float blacklevel);
+// Line numbers are stored as int8_t, in flat per line tables they are offset to start at 0
+constexpr int line_index_offset = 128;
+constexpr int num_line_bins = 256;
+
+// Line number of a phase as returned by LineGeometry::phaseRow
+inline int8_t lineIndex(float phase) {
+	return int(phase);
+}
+
+// Calibration factors of a single frame: the factor only depends on the line number of the pixel,
+// so it is a table lookup at the line phase and can be fused into any per pixel kernel.
+struct FrameGain {
+	LineGeometry lines;
+	std::array<float, num_line_bins> factors; // indexed by line number + line_index_offset
+
+	// Factors of row y, starting at pixel x_start
+	void row(int y, float * out, int width, int x_start = 0) const {
+		lines.phaseRow(y, out, width, x_start);
+		for (int x = 0; x < width; ++x) {
+			out[x] = factors[lineIndex(out[x]) + line_index_offset];
+		}
+	}
+
+	// Same factors, in the coordinates of an image region starting at origin
+	FrameGain cropped(cv::Point origin) const {
+		FrameGain region(*this);
+		region.lines = lines.cropped(origin);
+		return region;
+	}
+
+	// Mean of (frame - blacklevel) * factors, without storing the calibrated frame
+	double mean(const cv::Mat & frame, float blacklevel) const;
+};
+
+// How calibrated frames are combined element wise, across scan directions or over time
+enum class CombineOp {
+	Multiply,
+	Minimum,
+	Maximum,
+};
+
+// Everything the calibration factors of one scan direction follow from:
+//   factor(frame i, pixel) = 1 / frame_means[i] / line_means[line number of the pixel in frame i]
+// A few kilobytes instead of a full size factor image per frame.
+struct Calibration {
+	Lines lines;
+	std::vector<float> frame_means;
+	std::vector<float> line_means; // indexed by line number + line_index_offset
+	// Where the lines of each frame were measured, in line distances against the equal steps of
+	// offsetLines. Empty if the calibration was taken without tracking.
+	std::vector<double> frame_shifts;
+
+	// Running sums the means follow from, kept so that later acquisitions can be merged in.
+	// Empty for calibrations read from files written without them.
+	std::vector<double> frame_sums; // bright pixels in the center of each frame
+	std::vector<double> frame_num_elements;
+	std::vector<double> line_sums; // bright pixels of each line, normalized by the mean of their frame
+	std::vector<double> line_num_elements;
+
+	int size() const {
+		return frame_means.size();
+	}
+
+	bool mergeable() const {
+		return !line_sums.empty();
+	}
+	// Adds the sums of other, taken with the same lines and number of steps, and updates the means.
+	// Frame shifts are averaged, weighted by the bright pixels of the frame in either.
+	// Costs O(number of lines + steps), independent of how many frames went into either.
+	void merge(const Calibration & other);
+	// frame_means and line_means from the sums
+	void updateMeans();
+
+	// Lines of frame i, where they were measured if the calibration was tracked
+	LineGeometry frameLines(int i) const;
+	// Factors of frame i as a lookup table
+	FrameGain gain(int i) const;
+	// Factor image of frame i
+	cv::Mat factors(int i, cv::Size size) const;
+	// calibrated = (frame - blacklevel) * factors of frame i, evaluated on the fly.
+	// frame is widened on the fly, calibrated is CV_32FC1.
+	void apply(const cv::Mat & frame, int i, float blacklevel, cv::Mat & calibrated) const;
+	// combined = combine_op(combined, calibrated frame i), fused so the calibrated frame is never stored.
+	// combined must already be CV_32FC1 of the frame size.
+	void combine(const cv::Mat & frame, int i, float blacklevel, cv::Mat & combined, CombineOp combine_op) const;
+};
+
+// Calibration files are written with cv::FileStorage, so .yml, .yaml, .xml and .json (optionally .gz)
+bool isCalibrationFile(std::string filename);
+bool writeCalibrations(std::string filename, const std::vector<Calibration> & calibrations);
+// Returns an empty vector on failure
+std::vector<Calibration> readCalibrations(std::string filename);
+
+// Lines of frame frame of a scan of total_frames steps across one line distance
+Lines offsetLines(Lines lines, int frame, int total_frames, int shift_dir = 1);
+Calibration calculateCalibration(const Stack & in_images, Lines lines, float blacklevel);
+// Calibrations of several scan directions at once, the directions are processed concurrently.
+// With track_phase the lines of every frame are measured instead of assuming equal steps.
+std::vector<Calibration> calculateCalibrations(const std::vector<Stack> & in_images, const std::vector<Lines> & lines, float blacklevel, bool track_phase = false);
+// Factor images of every frame of the calibration
+Stack calculateCalibrationFactors(const Calibration & calibration, cv::Size size);
+// calibrated = (frame - blacklevel) * factors. frame is widened on the fly, calibrated is CV_32FC1.
+void applyCalibration(const cv::Mat & frame, float blacklevel, const cv::Mat & factors, cv::Mat & calibrated);
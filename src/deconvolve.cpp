@@ -0,0 +1,152 @@
+#include "deconvolve.h"
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <iostream>
+
+// Below this a modelled frame counts as 0
+constexpr float min_model = 1e-6f;
+
+Deconvolver::Deconvolver(float psf_sigma, int num_workers)
+	: psf_sigma(psf_sigma), num_workers(std::max(1, num_workers)) {
+}
+
+void Deconvolver::prepare(cv::Size frame_size) {
+	if (frame_size == size) {
+		return;
+	}
+	size = frame_size;
+	// Padded by 4 sigma, so the circular convolution does not wrap around the frame
+	int margin = std::ceil(4 * psf_sigma);
+	dft_size = cv::Size(cv::getOptimalDFTSize(size.width + margin), cv::getOptimalDFTSize(size.height + margin));
+
+	// Gaussian centered on pixel 0, wrapped around the borders
+	cv::Mat psf = cv::Mat::zeros(dft_size, CV_32FC1);
+	double psf_sum = 0;
+	for (int dy = -margin; dy <= margin; ++dy) {
+		for (int dx = -margin; dx <= margin; ++dx) {
+			float value = std::exp(-(dx*dx + dy*dy) / (2 * psf_sigma * psf_sigma));
+			psf.at<float>((dy + dft_size.height) % dft_size.height, (dx + dft_size.width) % dft_size.width) = value;
+			psf_sum += value;
+		}
+	}
+	psf /= psf_sum;
+	cv::dft(psf, psf_spectrum);
+
+	buffers.assign(num_workers, Buffers());
+	for (Buffers & worker : buffers) {
+		worker.padded = cv::Mat::zeros(dft_size, CV_32FC1);
+		worker.sum.create(size, CV_32FC1);
+	}
+
+	Buffers & first = buffers[0];
+	first.padded(cv::Rect(cv::Point(0, 0), size)) = 1;
+	convolve(first, true);
+	support_response = first.padded(cv::Rect(cv::Point(0, 0), size)).clone();
+}
+
+void Deconvolver::convolve(Buffers & worker, bool adjoint) const {
+	// Only the rows of the frame can be non zero
+	cv::dft(worker.padded, worker.spectrum, 0, size.height);
+	cv::mulSpectrums(worker.spectrum, psf_spectrum, worker.spectrum, 0, adjoint);
+	cv::dft(worker.spectrum, worker.padded, cv::DFT_INVERSE | cv::DFT_REAL_OUTPUT | cv::DFT_SCALE);
+}
+
+// Zeroes padded outside of the frame at its top left
+static void clearOutside(cv::Mat & padded, cv::Size size) {
+	padded(cv::Rect(size.width, 0, padded.cols - size.width, size.height)) = 0;
+	padded(cv::Rect(0, size.height, padded.cols, padded.rows - size.height)) = 0;
+}
+
+cv::Mat Deconvolver::reconstruct(const Stack & frames, const std::vector<LineGeometry> & lines, const PhaseLUT & profile,
+		int iterations, double iteration_budget) {
+	CV_Assert(frames.type() == CV_32FC1 && int(lines.size()) >= frames.size());
+	prepare(frames.frameSize());
+	int num_frames = frames.size();
+	const float * lut = profile.values.data();
+
+	// Denominator of the update: sum over the frames of the adjoint applied to 1, mask i . (psf' (*) support)
+	cv::Mat normalization = cv::Mat::zeros(size, CV_32FC1);
+	std::vector<float> phase(size.width);
+	for (int i = 0; i < num_frames; ++i) {
+		for (int y = 0; y < size.height; ++y) {
+			lines[i].wrappedPhaseRow(y, phase.data(), size.width);
+			float * row = normalization.ptr<float>(y);
+			for (int x = 0; x < size.width; ++x) {
+				row[x] += lut[profile.index(phase[x])];
+			}
+		}
+	}
+	normalization = normalization.mul(support_response);
+
+	// Starts from the mean of the frames
+	cv::Mat estimate;
+	cv::reduce(frames.frameMajor(), estimate, 0, cv::REDUCE_AVG);
+	estimate = estimate.reshape(1, size.height).clone();
+
+	for (int iteration = 0; iteration < iterations; ++iteration) {
+		int64_t start = cv::getTickCount();
+		// Frame i is handled by worker i % num_workers into its own sum, the sums are added in worker order
+		cv::parallel_for_(cv::Range(0, num_workers), [&](const cv::Range & range) {
+			std::vector<float> row_phase(size.width);
+			for (int w = range.start; w < range.end; ++w) {
+				Buffers & worker = buffers[w];
+				worker.sum = 0;
+				for (int i = w; i < num_frames; i += num_workers) {
+					// Forward: psf (*) (mask . estimate)
+					for (int y = 0; y < size.height; ++y) {
+						lines[i].wrappedPhaseRow(y, row_phase.data(), size.width);
+						const float * in = estimate.ptr<float>(y);
+						float * out = worker.padded.ptr<float>(y);
+						for (int x = 0; x < size.width; ++x) {
+							out[x] = lut[profile.index(row_phase[x])] * in[x];
+						}
+					}
+					clearOutside(worker.padded, size);
+					convolve(worker, false);
+
+					// Ratio of measured to modelled frame, only where there is a measurement
+					cv::Mat frame = frames[i];
+					for (int y = 0; y < size.height; ++y) {
+						const float * measured = frame.ptr<float>(y);
+						float * model = worker.padded.ptr<float>(y);
+						for (int x = 0; x < size.width; ++x) {
+							model[x] = measured[x] / std::max(model[x], min_model);
+						}
+					}
+					clearOutside(worker.padded, size);
+
+					// Adjoint: mask . (psf' (*) ratio)
+					convolve(worker, true);
+					for (int y = 0; y < size.height; ++y) {
+						lines[i].wrappedPhaseRow(y, row_phase.data(), size.width);
+						const float * back = worker.padded.ptr<float>(y);
+						float * sum = worker.sum.ptr<float>(y);
+						for (int x = 0; x < size.width; ++x) {
+							sum[x] += lut[profile.index(row_phase[x])] * back[x];
+						}
+					}
+				}
+			}
+		}, num_workers);
+
+		cv::Mat correction = buffers[0].sum.clone();
+		for (int w = 1; w < std::min(num_workers, num_frames); ++w) {
+			correction += buffers[w].sum;
+		}
+		for (int y = 0; y < size.height; ++y) {
+			float * value = estimate.ptr<float>(y);
+			const float * numerator = correction.ptr<float>(y);
+			const float * denominator = normalization.ptr<float>(y);
+			for (int x = 0; x < size.width; ++x) {
+				value[x] = denominator[x] > min_model ? value[x] * numerator[x] / denominator[x] : 0;
+			}
+		}
+
+		double seconds = (cv::getTickCount() - start) / cv::getTickFrequency();
+		if (iteration_budget > 0 && seconds > iteration_budget && iteration + 1 < iterations) {
+			std::cerr << "Iteration " << iteration + 1 << " took " << seconds << " s, stopping" << std::endl;
+			break;
+		}
+	}
+	return estimate;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <opencv2/core/core.hpp>
+#include <vector>
+#include "lines.h"
+#include "stack.h"
+
+// Joint reconstruction of the specimen from all frames of a scan with the model
+//   frame i = psf (*) (mask i . specimen)
+// where mask i is the illumination profile at the lines of frame i and psf a Gaussian.
+// Solved with Richardson-Lucy iterations, the convolutions are done with real to complex DFTs.
+// The PSF spectrum and all buffers only depend on the frame size, they are kept from one call
+// to the next so files of the same size reuse them.
+class Deconvolver {
+public:
+	Deconvolver(float psf_sigma, int num_workers);
+
+	// frames have to be CV_32FC1 with the blacklevel removed and not negative.
+	// Every iteration runs the frames in parallel on num_workers workers. Iterations stop early once one
+	// took longer than iteration_budget seconds, 0 for no limit.
+	cv::Mat reconstruct(const Stack & frames, const std::vector<LineGeometry> & lines, const PhaseLUT & profile,
+			int iterations, double iteration_budget = 0);
+
+private:
+	struct Buffers {
+		cv::Mat padded;
+		cv::Mat spectrum;
+		cv::Mat sum;
+	};
+
+	void prepare(cv::Size frame_size);
+	// padded = psf (*) padded, or the adjoint. Everything outside of the frame has to be 0.
+	void convolve(Buffers & buffers, bool adjoint) const;
+
+	float psf_sigma;
+	int num_workers;
+	cv::Size size;
+	cv::Size dft_size;
+	cv::Mat psf_spectrum; // packed, of dft_size
+	cv::Mat support_response; // adjoint of the psf applied to the frame support, of size
+	std::vector<Buffers> buffers;
+};
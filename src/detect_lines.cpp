@@ -1,63 +1,289 @@
 #include "detect_lines.h"
+#include "pixel_types.h"
 
 #include <opencv2/opencv.hpp>
+#include <complex>
+#include <algorithm>
+#include <array>
 
-constexpr bool debug = true;
+constexpr bool debug = false;
 
-MultiLine detect_lines(cv::Mat image) {
-	cv::Mat dft_res;
-	cv::dft(image, dft_res, cv::DFT_COMPLEX_OUTPUT);
+// Spectrum of a real image in the packed (CCS) layout of cv::dft without DFT_COMPLEX_OUTPUT.
+// For the horizontal frequencies 1 <= u <= (cols - 1) / 2 all vertical frequencies v are stored
+// as Re at column 2u - 1 and Im at column 2u of row v. Only these are looked up here.
+struct PackedSpectrum {
+	cv::Mat packed;
+
+	std::complex<float> at(int v, int u) const {
+		const float * row = packed.ptr<float>(v);
+		return std::complex<float>(row[2 * u - 1], row[2 * u]);
+	}
 
-	std::vector<cv::Mat> dfts(2);
-	cv::split(dft_res, dfts);
+	// Frequencies that can be looked up, (x = u, y = v)
+	cv::Rect stored() const {
+		return cv::Rect(1, 0, (packed.cols - 1) / 2, packed.rows);
+	}
 
-	cv::Mat mag;
-	cv::Mat phase;
-	cv::cartToPolar(dfts[0], dfts[1], mag, phase);
+	// Magnitude of the frequencies in region (x = u, y = v), nothing outside of it is evaluated
+	cv::Mat magnitude(cv::Rect region) const {
+		CV_Assert(region.x >= 1 && region.br().x - 1 <= (packed.cols - 1) / 2);
+		CV_Assert(region.y >= 0 && region.br().y <= packed.rows);
+		cv::Mat mag(region.size(), CV_32FC1);
+		for (int y = 0; y < region.height; ++y) {
+			float * mag_row = mag.ptr<float>(y);
+			for (int x = 0; x < region.width; ++x) {
+				mag_row[x] = std::abs(at(region.y + y, region.x + x));
+			}
+		}
+		return mag;
+	}
+};
 
-	cv::Mat top_left = mag(cv::Rect(1, 1, 200, 200));
-	top_left(cv::Rect(0, 0, 15, 15)) = 0;
-	top_left(cv::Rect(0, 0, 200, 2)) = 0;
-	top_left(cv::Rect(0, 0, 2, 200)) = 0;
+MultiLine detect_lines(cv::Mat image) {
+	// Padded to a size with a fast DFT, with the image mean so the border does not add a step.
+	// The frame is converted to float straight into the padded buffer.
+	cv::Size dft_size(cv::getOptimalDFTSize(image.cols), cv::getOptimalDFTSize(image.rows));
+	cv::Mat padded(dft_size, CV_32FC1, cv::mean(image));
+	cv::Mat image_area = padded(cv::Rect(cv::Point(0, 0), image.size()));
+	image.convertTo(image_area, CV_32FC1);
+
+	// Real to complex, half of the spectrum
+	PackedSpectrum spectrum;
+	cv::dft(padded, spectrum.packed);
+
+	// Search region cropped to the stored frequencies for small frames
+	cv::Mat top_left = spectrum.magnitude(cv::Rect(1, 1, 200, 200) & spectrum.stored());
+	cv::Rect top_left_area(cv::Point(0, 0), top_left.size());
+	top_left(cv::Rect(0, 0, 15, 15) & top_left_area) = 0;
+	top_left(cv::Rect(0, 0, 200, 2) & top_left_area) = 0;
+	top_left(cv::Rect(0, 0, 2, 200) & top_left_area) = 0;
 
 	if (debug) {
 		cv::imshow("dft", top_left/1000000);
-		cv::imshow("dftwin", mag/1000000);
 	}
 
 	double min, max;
 	cv::Point minloc, maxloc2;
 	cv::minMaxLoc(top_left, &min, &max, &minloc, &maxloc2);
 
-	std::cout << maxloc2 << std::endl;
-
 	// Find higher order frequency
 	int higher_fac = 5;
 	cv::Point higher_loc_approx = maxloc2*higher_fac;
-	cv::Mat higher = mag(cv::Rect(higher_loc_approx - cv::Point(5, 5), cv::Size(20, 20)));
+	cv::Rect higher_region = cv::Rect(higher_loc_approx - cv::Point(5, 5), cv::Size(20, 20)) & spectrum.stored();
+	if (higher_region.empty()) {
+		// Harmonic beyond the stored frequencies, use the fundamental
+		higher_fac = 1;
+		higher_region = cv::Rect(maxloc2 + cv::Point(1, 1), cv::Size(1, 1));
+	}
+	cv::Point higher_origin = higher_region.tl();
+	cv::Mat higher = spectrum.magnitude(higher_region);
 	if (debug) cv::imshow("higher", higher/1000000);
 	cv::Point maxloc;
 	cv::minMaxLoc(higher, &min, &max, &minloc, &maxloc);
-	maxloc += higher_loc_approx - cv::Point(5, 5);
+	maxloc += higher_origin;
 	cv::Point2f freq2d = cv::Point2f(maxloc) / higher_fac;
 
-	std::cout << maxloc << std::endl;
-	std::cout << freq2d<< std::endl;
-
-	double fdx = freq2d.x / image.cols;
-	double fdy = freq2d.y / image.rows;
-
-	std::cout << fdx << ", " << fdy << std::endl;
+	// Frequency bins are relative to the padded size
+	double fdx = freq2d.x / dft_size.width;
+	double fdy = freq2d.y / dft_size.height;
 
 	MultiLine lines;
 	double frequency = std::sqrt(std::pow(fdx, 2) + std::pow(fdy, 2));
 	lines.distance = 1 / frequency;
-	lines.zero_line.orientation = std::atan2(fdy, fdx) + M_PI/2;
-
-	std::cout << phase.at<float>(maxloc) << std::endl;
-	lines.zero_line.offset = (phase.at<float>(maxloc) / 2*M_PI + 0.5) * lines.distance;
+	lines.zero_line.orientation = -std::atan2(fdy, fdx);
 
-	std::cout << lines.distance << " | " << lines.zero_line.orientation << " | " << lines.zero_line.offset << std::endl;
+	// The harmonic bin only gives the phase modulo a fifth of a period, so the phase is measured with a
+	// single frequency DFT of the frame at the refined fundamental. Lines are at the intensity maxima.
+	lines.zero_line.offset = 0;
+	double offset = measureLinePhase(image_area, 0, LineGeometry(lines));
+	lines.zero_line.offset = (offset - std::floor(offset)) * lines.distance;
 
 	return lines;
 }
+
+// Mean intensity along u = x cos(angle) - y sin(angle), the axis across lines of that orientation,
+// in bins of one pixel. Only every row_step-th row is used, u precision does not depend on it.
+struct Projection {
+	std::vector<float> profile; // mean of the profile subtracted, empty bins are 0
+	double u_start; // u at the start of bin 0
+
+	double u(int bin) const {
+		return u_start + bin + 0.5;
+	}
+
+	// Single frequency DFT of the profile, frequency in cycles per pixel.
+	// The phasor is rotated from bin to bin, no trigonometry per bin.
+	std::complex<double> dft(double frequency) const {
+		std::complex<double> z = std::polar(1.0, -2 * M_PI * frequency * u(0));
+		std::complex<double> w = std::polar(1.0, -2 * M_PI * frequency);
+		std::complex<double> sum = 0;
+		for (float value : profile) {
+			sum += double(value) * z;
+			z *= w;
+		}
+		return sum;
+	}
+
+	// Amplitude of the pattern at frequency, comparable between projections of different length
+	double magnitude(double frequency) const {
+		return std::abs(dft(frequency)) / profile.size();
+	}
+};
+
+static Projection project(const cv::Mat & image, double angle, int row_step) {
+	double c = std::cos(angle);
+	double s = std::sin(angle);
+	double w = image.cols - 1;
+	double h = image.rows - 1;
+	double u_min = std::min({0.0, w * c, -h * s, w * c - h * s});
+	double u_max = std::max({0.0, w * c, -h * s, w * c - h * s});
+	int num_bins = int(u_max - u_min) + 1;
+
+	std::vector<float> sums(num_bins, 0);
+	std::vector<int> counts(num_bins, 0);
+	dispatchNativeDepth(image.depth(), [&]<typename T>(const T *) {
+		for (int y = 0; y < image.rows; y += row_step) {
+			const T * row = image.ptr<T>(y);
+			double u_row = -y * s - u_min;
+			for (int x = 0; x < image.cols; ++x) {
+				int bin = std::min(int(u_row + x * c), num_bins - 1);
+				sums[bin] += row[x];
+				counts[bin]++;
+			}
+		}
+	});
+
+	Projection projection;
+	projection.u_start = u_min;
+	projection.profile.resize(num_bins);
+	double mean = 0;
+	int filled = 0;
+	for (int bin = 0; bin < num_bins; ++bin) {
+		if (counts[bin] > 0) {
+			projection.profile[bin] = sums[bin] / counts[bin];
+			mean += projection.profile[bin];
+			filled++;
+		}
+	}
+	mean /= std::max(filled, 1);
+	for (int bin = 0; bin < num_bins; ++bin) {
+		projection.profile[bin] = counts[bin] > 0 ? projection.profile[bin] - mean : 0;
+	}
+	return projection;
+}
+
+// Vertex of the parabola through (-1, left), (0, center), (1, right), in [-1, 1]
+static double parabolicPeak(double left, double center, double right) {
+	double denominator = left - 2 * center + right;
+	if (denominator >= 0) {
+		return 0;
+	}
+	return std::clamp(0.5 * (left - right) / denominator, -1.0, 1.0);
+}
+
+// Frequency of the strongest pattern within center +- half_width and its magnitude
+static double peakFrequency(const Projection & projection, double center, double half_width, double * magnitude) {
+	constexpr int steps = 8;
+	std::array<double, 2 * steps + 1> magnitudes;
+	for (int j = -steps; j <= steps; ++j) {
+		magnitudes[j + steps] = projection.magnitude(center + half_width * j / steps);
+	}
+	int best = std::max_element(magnitudes.begin(), magnitudes.end()) - magnitudes.begin();
+	double frequency = center + half_width * (best - steps) / steps;
+	if (best > 0 && best < 2 * steps) {
+		frequency += half_width / steps * parabolicPeak(magnitudes[best - 1], magnitudes[best], magnitudes[best + 1]);
+	}
+	*magnitude = projection.magnitude(frequency);
+	return frequency;
+}
+
+bool detect_lines_projection(cv::Mat image, MultiLine & lines, float min_distance, float max_distance) {
+	// Projected in the depth it comes in
+	cv::Mat frame = image;
+	if (!isNativeDepth(frame.depth())) {
+		image.convertTo(frame, CV_32FC1);
+	}
+	cv::Size size = frame.size();
+	auto center_crop = [&](int crop_size) {
+		cv::Size crop(std::min(crop_size, size.width), std::min(crop_size, size.height));
+		return frame(cv::Rect((size.width - crop.width) / 2, (size.height - crop.height) / 2, crop.width, crop.height));
+	};
+
+	// Coarse search over all orientations on a small central crop. The angle resolution needed only
+	// depends on the extent of the projected region, not on its sampling: across crop_size pixels
+	// an angle error of step moves the lines by at most a quarter of the smallest line distance.
+	int crop_size = 256;
+	cv::Mat crop = center_crop(crop_size);
+	double max_crop_size = std::max(crop.cols, crop.rows);
+	double coarse_step = std::min(M_PI / 180, min_distance / (4 * max_crop_size));
+	int num_angles = std::ceil(M_PI / coarse_step);
+	std::vector<double> coarse_magnitudes(num_angles);
+	std::vector<double> coarse_frequencies(num_angles);
+	cv::parallel_for_(cv::Range(0, num_angles), [&](const cv::Range & range) {
+		for (int a = range.start; a < range.end; ++a) {
+			Projection projection = project(crop, a * coarse_step, 4);
+			// Frequencies the profile resolves
+			double span = projection.profile.size();
+			double best = 0;
+			for (int k = std::ceil(span / max_distance); k <= span / min_distance; ++k) {
+				double magnitude = projection.magnitude(k / span);
+				if (magnitude > best) {
+					best = magnitude;
+					coarse_frequencies[a] = k / span;
+				}
+			}
+			coarse_magnitudes[a] = best;
+		}
+	});
+	int best_angle = std::max_element(coarse_magnitudes.begin(), coarse_magnitudes.end()) - coarse_magnitudes.begin();
+	if (!(coarse_magnitudes[best_angle] > 0)) {
+		// Uniform frame, no frequency stands out
+		return false;
+	}
+	double angle = best_angle * coarse_step;
+	double frequency = coarse_frequencies[best_angle];
+	double frequency_width = 1.0 / max_crop_size;
+
+	// Refinement on growing crops up to the full frame. Each stage fits a parabola to the magnitudes of
+	// the neighbouring orientations, at a step small enough for the extent of that crop.
+	while (true) {
+		crop = center_crop(crop_size);
+		max_crop_size = std::max(crop.cols, crop.rows);
+		int row_step = std::max(1, crop.rows / 256);
+		double step = 1 / frequency / (4 * max_crop_size);
+		std::array<double, 3> magnitudes;
+		std::array<double, 3> frequencies;
+		cv::parallel_for_(cv::Range(0, 3), [&](const cv::Range & range) {
+			for (int j = range.start; j < range.end; ++j) {
+				Projection projection = project(crop, angle + (j - 1) * step, row_step);
+				frequencies[j] = peakFrequency(projection, frequency, frequency_width, &magnitudes[j]);
+			}
+		});
+		angle += step * parabolicPeak(magnitudes[0], magnitudes[1], magnitudes[2]);
+		frequency = frequencies[1];
+		frequency_width = 1.0 / max_crop_size;
+		if (!(frequency > 0) || !std::isfinite(angle)) {
+			return false;
+		}
+		if (crop.size() == size) {
+			break;
+		}
+		crop_size *= 2;
+	}
+
+	// Period and phase from the targeted DFT of the full frame at the final orientation
+	Projection projection = project(frame, angle, 2);
+	double magnitude;
+	frequency = peakFrequency(projection, frequency, frequency_width, &magnitude);
+	if (!(frequency > 0)) {
+		return false;
+	}
+	double phase = std::arg(projection.dft(frequency));
+
+	lines.distance = 1 / frequency;
+	lines.zero_line.orientation = angle;
+	// Lines are at the maxima of the profile: u = offset + k * distance
+	double offset = -phase / (2 * M_PI);
+	lines.zero_line.offset = (offset - std::floor(offset)) * lines.distance;
+	return true;
+}
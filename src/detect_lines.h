@@ -2,3 +2,9 @@
 #include "lines.h"
 
 MultiLine detect_lines(cv::Mat image);
+
+// Detection from 1D projections instead of the 2D spectrum: a coarse orientation search on a
+// small crop, refined on growing crops, then period and phase from a single frequency DFT of the
+// projection of the whole frame. Distances are in pixels, the line distance has to lie in between.
+// Returns false if the frame shows no line pattern, e.g. if it is blank or saturated.
+bool detect_lines_projection(cv::Mat image, MultiLine & lines, float min_distance = 8, float max_distance = 64);
@@ -0,0 +1,111 @@
+#include "frames.h"
+#include <iostream>
+#include <algorithm>
+
+FrameReader::FrameReader(std::string filename, int flags)
+	: index(0) {
+	try {
+		collection.init(filename, flags);
+	} catch (const cv::Exception & e) {
+		std::cerr << "Could not open " << filename << std::endl;
+	}
+}
+
+bool FrameReader::isOpened() {
+	return collection.size() > 0;
+}
+
+int FrameReader::size() {
+	return collection.size();
+}
+
+bool FrameReader::read(cv::Mat & frame) {
+	if (index >= size()) {
+		return false;
+	}
+	// Keep our own header on the page data and drop it from the collection cache
+	frame = collection.at(index);
+	collection.releaseCache(index);
+	index++;
+	return !frame.empty();
+}
+
+PrefetchReader::PrefetchReader(std::vector<std::string> filenames, int depth)
+	: queue(std::max(1, depth)), num_frames(0), at_file_end(true) {
+	thread = std::thread([this, filenames] {
+		for (const std::string & filename : filenames) {
+			FrameReader reader(filename);
+			if (!queue.push(Item{Item::FileStart, reader.isOpened() ? reader.size() : -1, cv::Mat()})) {
+				return;
+			}
+			cv::Mat page;
+			while (reader.read(page)) {
+				if (!queue.push(Item{Item::Page, 0, page})) {
+					return;
+				}
+			}
+			if (!queue.push(Item{Item::FileEnd, 0, cv::Mat()})) {
+				return;
+			}
+		}
+		queue.close();
+	});
+}
+
+PrefetchReader::~PrefetchReader() {
+	// Stops the reader thread if the consumer gave up early
+	queue.close();
+	thread.join();
+}
+
+bool PrefetchReader::nextFile() {
+	Item item;
+	// Skips what is left of the previous file
+	while (queue.pop(item)) {
+		if (item.kind == Item::FileStart) {
+			num_frames = item.num_frames;
+			at_file_end = false;
+			return num_frames > 0;
+		}
+	}
+	return false;
+}
+
+int PrefetchReader::size() {
+	return num_frames;
+}
+
+bool PrefetchReader::read(cv::Mat & frame) {
+	if (at_file_end) {
+		return false;
+	}
+	Item item;
+	if (!queue.pop(item) || item.kind != Item::Page) {
+		at_file_end = true;
+		return false;
+	}
+	frame = item.page;
+	return true;
+}
+
+BackgroundWriter::BackgroundWriter(int depth)
+	: queue(std::max(1, depth)) {
+	thread = std::thread([this] {
+		std::pair<std::string, cv::Mat> item;
+		while (queue.pop(item)) {
+			if (!cv::imwrite(item.first, item.second)) {
+				std::cerr << "Could not write " << item.first << std::endl;
+			}
+		}
+	});
+}
+
+BackgroundWriter::~BackgroundWriter() {
+	// Everything queued so far is still written
+	queue.close();
+	thread.join();
+}
+
+void BackgroundWriter::write(std::string filename, cv::Mat image) {
+	queue.push(std::make_pair(filename, image));
+}
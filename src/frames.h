@@ -0,0 +1,65 @@
+#pragma once
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <string>
+#include <vector>
+#include <thread>
+#include "queue.h"
+
+// Reads a multi page image file one page at a time.
+// Only the page that was handed out last is kept alive, so memory does not grow with the stack length.
+class FrameReader {
+public:
+	FrameReader(std::string filename, int flags = cv::IMREAD_GRAYSCALE | cv::IMREAD_ANYDEPTH);
+
+	bool isOpened();
+	int size();
+
+	// Decode the next page. Returns false once all pages have been read.
+	bool read(cv::Mat & frame);
+
+private:
+	cv::ImageCollection collection;
+	int index;
+};
+
+// Decodes the pages of several files in order on a background thread, at most depth pages
+// ahead of the consumer. Decoding the next file overlaps with processing the current one.
+class PrefetchReader {
+public:
+	PrefetchReader(std::vector<std::string> filenames, int depth);
+	~PrefetchReader();
+
+	// Move on to the next file. Returns false if it could not be opened or there are no more files.
+	bool nextFile();
+	// Number of pages of the current file
+	int size();
+
+	// Next page of the current file. Returns false once all its pages have been read.
+	bool read(cv::Mat & frame);
+
+private:
+	struct Item {
+		enum Kind { FileStart, Page, FileEnd } kind;
+		int num_frames; // FileStart only, -1 if the file could not be opened
+		cv::Mat page;
+	};
+	BoundedQueue<Item> queue;
+	std::thread thread;
+	int num_frames;
+	bool at_file_end;
+};
+
+// Writes images on a background thread, at most depth images wait to be written.
+// The destructor waits until everything has been written.
+class BackgroundWriter {
+public:
+	BackgroundWriter(int depth);
+	~BackgroundWriter();
+
+	void write(std::string filename, cv::Mat image);
+
+private:
+	BoundedQueue<std::pair<std::string, cv::Mat>> queue;
+	std::thread thread;
+};
@@ -1,5 +1,7 @@
 #include "lines.h"
+#include "pixel_types.h"
 #include <cmath>
+#include <algorithm>
 #include <opencv2/opencv.hpp>
 
 Lines linesFromPoints(std::array<cv::Point, 3> points, int num_lines) {
@@ -22,20 +24,180 @@ Lines linesFromPoints(std::array<cv::Point, 3> points, int num_lines) {
 	return lines;
 }
 
-int8_t lineNumAtPoint(MultiLine lines, cv::Point point) {
-    // rotate coords by orientation
-	float x = point.x * std::cos(lines.zero_line.orientation) - point.y * std::sin(lines.zero_line.orientation);
+LineGeometry::LineGeometry(float orientation, float offset, float distance)
+	: distance(distance) {
+	// rotate coords by orientation, then calculate line num as if lines were vertical
+	phase_dx = std::cos(orientation) / distance;
+	phase_dy = -std::sin(orientation) / distance;
+	phase_0 = -offset / distance;
+}
+
+LineGeometry::LineGeometry(MultiLine lines)
+	: LineGeometry(lines.zero_line.orientation, lines.zero_line.offset, lines.distance) {
+}
+
+LineGeometry::LineGeometry(Lines lines)
+	: LineGeometry(lines.orientation, lines.offset, lines.distance) {
+}
+
+void LineGeometry::phaseRow(int y, float * row, int width, int x_start) const {
+	double start = phase(x_start, y);
+	for (int x = 0; x < width; ++x) {
+		row[x] = start + x * phase_dx;
+	}
+}
+
+void LineGeometry::wrappedPhaseRow(int y, float * row, int width, int x_start) const {
+	// Only the start of the row is wrapped exactly, from there on the phase is stepped
+	// and wrapped around incrementally which avoids a remainder per pixel.
+	double start = phase(x_start, y);
+	float p = start - std::floor(start + 0.5);
+	float step = phase_dx;
+	for (int x = 0; x < width; ++x) {
+		row[x] = p;
+		p += step;
+		if (p >= 0.5f || p < -0.5f) {
+			p -= std::floor(p + 0.5f);
+		}
+	}
+}
+
+void LineGeometry::bandRuns(int y, int width, float center, float radius, std::vector<cv::Range> & runs) const {
+	runs.clear();
+	if (radius <= 0) {
+		return;
+	}
+	double start = phase(0, y) - center;
+	if (radius >= 0.5 || std::abs(phase_dx) * width < 1e-6) {
+		// Every pixel or the whole row lies in the same band
+		if (radius >= 0.5 || std::abs(start - std::floor(start + 0.5)) < radius) {
+			runs.push_back(cv::Range(0, width));
+		}
+		return;
+	}
+	// Band k covers (k - radius, k + radius) of start + x * phase_dx
+	double end = start + phase_dx * width;
+	int k_first = std::floor(std::min(start, end) - radius);
+	int k_last = std::ceil(std::max(start, end) + radius);
+	for (int k = k_first; k <= k_last; ++k) {
+		double x1 = (k - radius - start) / phase_dx;
+		double x2 = (k + radius - start) / phase_dx;
+		int run_start = std::max(0, int(std::ceil(std::min(x1, x2))));
+		int run_end = std::min(width, int(std::floor(std::max(x1, x2))) + 1);
+		if (run_start < run_end) {
+			runs.push_back(cv::Range(run_start, run_end));
+		}
+	}
+	if (phase_dx < 0) {
+		std::reverse(runs.begin(), runs.end());
+	}
+}
 
-	// now calculate line num as is lines were vertical
-	return std::abs(fmod((x - lines.zero_line.offset), lines.distance)) < 3;
+PhaseLUT::PhaseLUT(std::function<float(float)> fn, int samples)
+	: values(samples) {
+	for (int i = 0; i < samples; ++i) {
+		// Sample at the bin centers
+		values[i] = fn((i + 0.5f) / samples - 0.5f);
+	}
+}
+
+PhaseLUT::Band PhaseLUT::support(float threshold) const {
+	int n = values.size();
+	int first_above = -1;
+	for (int i = 0; i < n; ++i) {
+		if (values[i] > threshold) {
+			first_above = i;
+			break;
+		}
+	}
+	if (first_above < 0) {
+		return Band{0, 0};
+	}
+	// The support is everything but the longest (circular) gap below the threshold
+	int gap_start = 0;
+	int gap_length = 0;
+	int current_length = 0;
+	for (int j = 1; j <= n; ++j) {
+		int i = (first_above + j) % n;
+		if (values[i] > threshold) {
+			if (current_length > gap_length) {
+				gap_length = current_length;
+				gap_start = (i - current_length + n) % n;
+			}
+			current_length = 0;
+		} else {
+			current_length++;
+		}
+	}
+	if (gap_length == 0) {
+		return Band{0, 0.5};
+	}
+	int support_start = gap_start + gap_length;
+	int support_length = n - gap_length;
+	float center = (support_start + support_length / 2.f) / n - 0.5f;
+	center -= std::floor(center + 0.5f);
+	return Band{center, support_length / (2.f * n)};
+}
+
+cv::Mat PhaseLUT::render(LineGeometry lines, cv::Size size) const {
+	cv::Mat image(size, CV_32FC1);
+	for (int y = 0; y < size.height; ++y) {
+		float * row = image.ptr<float>(y);
+		lines.wrappedPhaseRow(y, row, size.width);
+		for (int x = 0; x < size.width; ++x) {
+			row[x] = values[index(row[x])];
+		}
+	}
+	return image;
+}
+
+float measureLinePhase(const cv::Mat & frame, float blacklevel, const LineGeometry & lines, double * mean) {
+	CV_Assert(frame.channels() == 1);
+	// e^(-2 pi i phase) over one line period
+	static const PhaseLUT cos_lut([](float phase) { return std::cos(2 * M_PI * phase); });
+	static const PhaseLUT sin_lut([](float phase) { return -std::sin(2 * M_PI * phase); });
+	const float * cos_values = cos_lut.values.data();
+	const float * sin_values = sin_lut.values.data();
+
+	std::vector<float> phase(frame.cols);
+	double sum = 0;
+	double re = 0;
+	double im = 0;
+	dispatchNativeDepth(frame.depth(), [&]<typename T>(const T *) {
+		for (int y = 0; y < frame.rows; ++y) {
+			lines.wrappedPhaseRow(y, phase.data(), frame.cols);
+			const T * in = frame.ptr<T>(y);
+			float row_sum = 0;
+			float row_re = 0;
+			float row_im = 0;
+			for (int x = 0; x < frame.cols; ++x) {
+				float value = in[x] - blacklevel;
+				int i = cos_lut.index(phase[x]);
+				row_sum += value;
+				row_re += value * cos_values[i];
+				row_im += value * sin_values[i];
+			}
+			sum += row_sum;
+			re += row_re;
+			im += row_im;
+		}
+	});
+	if (mean) {
+		*mean = sum / frame.total();
+	}
+	// For frame ~ cos(2 pi (phase - m)) the sum is ~ e^(-2 pi i m)
+	return wrapPhase(-std::atan2(im, re) / (2 * M_PI));
 }
 
-cv::Mat draw_lines(MultiLine lines, cv::Size size) {
+cv::Mat draw_lines(LineGeometry lines, cv::Size size) {
 	cv::Mat mask(size, CV_8UC1);
+	std::vector<float> phase(size.width);
+	float threshold = 3 / lines.distance;
 	for (int y = 0; y < size.height; ++y) {
+		lines.wrappedPhaseRow(y, phase.data(), size.width);
+		uint8_t * mask_row = mask.ptr<uint8_t>(y);
 		for (int x = 0; x < size.width; ++x) {
-			int8_t index = lineNumAtPoint(lines, cv::Point(x, y)) * 255;
-			mask.at<int8_t>(x, y) = index;
+			mask_row[x] = std::abs(phase[x]) < threshold ? 255 : 0;
 		}
 	}
 	return mask;
@@ -3,6 +3,7 @@
 #include <string>
 #include <vector>
 #include <array>
+#include <functional>
 //#include <eigen3/Eigen/Core>
 
 struct Lines {
@@ -73,16 +74,87 @@ struct MultiLine {
 		return shifted;
 	}
 
-	float pointDistance(cv::Point point) {
-		// rotate coords by orientation
-		float x = - point.x * std::cos(this->zero_line.orientation - M_PI/2) - point.y * std::sin(this->zero_line.orientation - M_PI/2);
+};
+
+// Position perpendicular to a set of parallel lines, in units of the line distance.
+// It is affine in the pixel position: phase(x, y) = x * phase_dx + y * phase_dy + phase_0
+// Line k lies at phase k. The trigonometry is done once here, evaluating it only needs adds.
+struct LineGeometry {
+	double phase_dx;
+	double phase_dy;
+	double phase_0;
+	float distance; //pixels between lines
+
+	LineGeometry(float orientation, float offset, float distance);
+	LineGeometry(MultiLine lines);
+	LineGeometry(Lines lines);
+
+	double phase(float x, float y) const {
+		return x * phase_dx + y * phase_dy + phase_0;
+	}
+
+	// Same lines, in the coordinates of an image region starting at origin
+	LineGeometry cropped(cv::Point origin) const {
+		LineGeometry region(*this);
+		region.phase_0 = phase(origin.x, origin.y);
+		return region;
+	}
 
-		// now calculate line num as is lines were vertical
-		return std::abs(remainderf((x - this->zero_line.offset), this->distance));
+	// Lines moved across by shift line distances
+	LineGeometry shifted(double shift) const {
+		LineGeometry moved(*this);
+		moved.phase_0 -= shift;
+		return moved;
 	}
 
+	// Phase of row y, starting at pixel x_start
+	void phaseRow(int y, float * row, int width, int x_start = 0) const;
+	// Phase of row y relative to the closest line, in [-0.5, 0.5), starting at pixel x_start
+	void wrappedPhaseRow(int y, float * row, int width, int x_start = 0) const;
+
+	// Pixel ranges of row y whose phase is within radius of center + k for any line k
+	void bandRuns(int y, int width, float center, float radius, std::vector<cv::Range> & runs) const;
+};
+
+// A function of the line phase sampled over one line period.
+// All lines of all frames share the same profile, only the phase differs, so a
+// table of a few kilobytes can stand in for full size mask images.
+struct PhaseLUT {
+	std::vector<float> values;
+
+	// fn is evaluated at the wrapped phase in [-0.5, 0.5), 0 being the line center
+	PhaseLUT(std::function<float(float)> fn, int samples = 4096);
+
+	// Index of a wrapped phase as returned by LineGeometry::wrappedPhaseRow
+	int index(float wrapped_phase) const {
+		int i = (wrapped_phase + 0.5f) * values.size();
+		return std::min(i, int(values.size()) - 1);
+	}
+
+	float operator()(float wrapped_phase) const {
+		return values[index(wrapped_phase)];
+	}
+
+	// Phase interval center +- radius (wrapped) outside of which the profile is below threshold
+	struct Band {
+		float center;
+		float radius;
+	};
+	Band support(float threshold) const;
+
+	// Full size image of the profile, mostly for display
+	cv::Mat render(LineGeometry lines, cv::Size size) const;
 };
 
-cv::Mat draw_lines(MultiLine lines, cv::Size size);
+cv::Mat draw_lines(LineGeometry lines, cv::Size size);
 
+// Where the line pattern of frame - blacklevel actually is, measured with a single frequency DFT at
+// the line frequency of lines: the intensity maxima lie at phase k + result, result in [-0.5, 0.5).
+// A lookup and three multiply-adds per pixel. mean receives the mean of frame - blacklevel from
+// the same pass, so it can stand in for the frame mean pass of a caller.
+float measureLinePhase(const cv::Mat & frame, float blacklevel, const LineGeometry & lines, double * mean = nullptr);
 
+// x wrapped to [-0.5, 0.5)
+inline double wrapPhase(double x) {
+	return x - std::floor(x + 0.5);
+}
@@ -0,0 +1,203 @@
+#include <string>
+#include <stdexcept>
+#include <stdint.h>
+#include <vector>
+#include <array>
+#include <opencv2/opencv.hpp>
+#include "clipp.hpp"
+#include "calibration.h"
+#include "frames.h"
+#include "accumulate.h"
+#include "stack.h"
+#include "pixel_types.h"
+#include <filesystem>
+using namespace clipp;
+
+// calibrate, apply_calibration and scasub in one process. The calibration is applied inside the
+// scasub kernel on the raw frames, so neither calibrated frames nor factor images are ever stored.
+int main(int argc, char** argv) {
+	bool help = false;
+	std::string calibration_filename;
+	std::vector<std::string> image_filenames;
+	std::string points;
+	std::string save_calibration_filename;
+	int num_images = 0;
+	int num_directions = 0;
+	float alpha_fac = 1.0;
+	float blacklevel;
+	std::string output_folder;
+	bool no_subtract = false;
+	float mask_threshold = 0;
+	int threads = 1;
+	bool threads_given = false;
+	int prefetch = 16;
+
+	auto cli = (
+		option("-h", "--help").set(help) % "Show documentation." |
+		(
+			required("-c") & value("calibration", calibration_filename) % "Calibration recording, or a calibration file written by calibrate",
+			option("-p") & value("points", points) % "3 line defining points per direction, needed to calibrate from a recording",
+			option("-n") & value("num_images", num_images) % "Frames per direction, needed to calibrate from a recording",
+			option("-d") & value("num_directions", num_directions) % "Needed to calibrate from a recording",
+			option("--save-calibration") & value("file", save_calibration_filename) % "Also write the calibration to this file",
+			option("--no-subtract").set(no_subtract),
+			option("-a") & value("alpha factor", alpha_fac),
+			option("-t", "--mask-threshold") & value("threshold", mask_threshold) % "Skip pixels where the mask weight is below threshold. 0 (default) visits every pixel.",
+			option("--threads").set(threads_given) & value("threads", threads) % "Number of frames processed in parallel (default 1), also limits the OpenCV thread pool. Without it OpenCV keeps its default pool.",
+			option("--prefetch") & value("frames", prefetch) % "Frames decoded ahead on the reader thread, also across files (default 16).",
+			required("-b") & value("blacklevel", blacklevel),
+			required("-i") & values("images", image_filenames) % "Recordings with the same direction layout as the calibration",
+			option("-o") & value("output folder", output_folder)
+		)
+	);
+
+	auto fmt = doc_formatting{}.doc_column(30);
+	const char* exe_name = "pipeline";
+	parsing_result parse_result = parse(argc, argv, cli);
+	if (!parse_result) {
+		std::cerr << "Invalid arguments. See arguments below or use " << exe_name << " -h for more info\n";
+		std::cerr << usage_lines(cli, exe_name, fmt) << '\n';
+		return 1;
+	}
+
+	if (help) {
+		std::cout << make_man_page(cli, exe_name, fmt) << '\n';
+		return 0;
+	}
+
+	if (threads_given) {
+		cv::setNumThreads(threads);
+	}
+
+	std::vector<Calibration> calibrations;
+	if (isCalibrationFile(calibration_filename)) {
+		calibrations = readCalibrations(calibration_filename);
+		if (calibrations.empty()) {
+			std::cerr << "Could not read calibration" << std::endl;
+			return 2;
+		}
+	} else {
+		if (num_images <= 0 || num_directions <= 0) {
+			std::cerr << "-n and -d are needed to calibrate from a recording" << std::endl;
+			return 1;
+		}
+		auto ps = parsePoints(points);
+		if (ps.size() != num_directions * 3) {
+			std::cerr << "need " << num_directions * 3 << " input points" << std::endl;
+			return 1;
+		}
+		// Only held while calibrating
+		Stack in_images = Stack::read(calibration_filename, -1);
+		if (in_images.empty()) {
+			std::cerr << "Could not read images" << std::endl;
+			return 2;
+		}
+		if (num_directions * num_images > in_images.size()) {
+			std::cerr << "Too few images in input file" << std::endl;
+			return 2;
+		}
+		std::vector<Stack> direction_images;
+		std::vector<Lines> direction_lines;
+		for (int direction_idx = 0; direction_idx < num_directions; ++direction_idx) {
+			std::array<cv::Point, 3> direction_points;
+			std::copy(ps.begin() + direction_idx * 3, ps.begin() + (direction_idx + 1) * 3, direction_points.begin());
+			direction_images.push_back(in_images.range(direction_idx * num_images, num_images));
+			direction_lines.push_back(linesFromPoints(direction_points, 10));
+		}
+		calibrations = calculateCalibrations(direction_images, direction_lines, blacklevel);
+	}
+	if (!save_calibration_filename.empty() && !writeCalibrations(save_calibration_filename, calibrations)) {
+		std::cerr << "Could not write " << save_calibration_filename << std::endl;
+		return 2;
+	}
+
+	// Per direction: mask profiles and the calibration factors of every frame, which hold the lines of the frame.
+	// These are measured ones for tracked calibrations, the masks are placed on the same lines.
+	struct Direction {
+		PhaseLUT on_profile;
+		PhaseLUT off_profile;
+		std::vector<FrameGain> gains;
+	};
+	std::vector<Direction> directions;
+	for (const Calibration & calibration : calibrations) {
+		std::vector<FrameGain> gains;
+		for (int i = 0; i < calibration.size(); ++i) {
+			gains.push_back(calibration.gain(i));
+		}
+		float distance = calibration.lines.distance;
+		directions.push_back(Direction{onProfile(distance), offProfile(distance), gains});
+	}
+
+	// As in scasub frame i of a batch is accumulated by worker i into its own partial sums,
+	// which are reduced in worker order.
+	BatchAccumulator accumulator(threads);
+	PrefetchReader reader(image_filenames, prefetch);
+	BackgroundWriter writer(2);
+
+	for (std::string image_filename : image_filenames) {
+		std::cerr << "File " << image_filename << std::endl;
+		if (!reader.nextFile()) {
+			std::cerr << "Could not read images " << image_filename << std::endl;
+			return 2;
+		}
+
+		// Directions follow each other in the file, each one is reconstructed on its own
+		for (int direction_idx = 0; direction_idx < int(calibrations.size()); ++direction_idx) {
+			const Direction & direction = directions[direction_idx];
+			int num_frames = calibrations[direction_idx].size();
+			std::vector<float> frame_means(num_frames);
+
+			BatchAccumulator::Callbacks callbacks;
+			// Mean of the calibrated frame, the frame is normalized by it like in scasub
+			callbacks.prepare = [&](const cv::Mat & image, int i) {
+				frame_means[i] = direction.gains[i].mean(image, blacklevel);
+			};
+			callbacks.accumulate = [&](const cv::Mat & image, int i, cv::Rect roi, int w) {
+				FrameGain gain = direction.gains[i].cropped(roi.tl());
+				// Calibration lines are shifted by half a line distance against the ones of scasub,
+				// so lines fall in the middle of the line number bins
+				LineGeometry frame_lines = direction.gains[i].lines.shifted(-0.5).cropped(roi.tl());
+				cv::Mat on = accumulator.onPartials()[w](roi);
+				cv::Mat off = accumulator.offPartials()[w](roi);
+				accumulateOnOff(image(roi), blacklevel, 1.f / frame_means[i], gain, frame_lines,
+						direction.on_profile, direction.off_profile, on, off, mask_threshold);
+			};
+			int frames_read = accumulator.run(reader, num_frames, 1, callbacks);
+			if (frames_read < 0) {
+				return 2;
+			}
+			if (frames_read < num_frames) {
+				std::cerr << "Too few images in " << image_filename << std::endl;
+				return 2;
+			}
+
+			cv::Mat on_result;
+			cv::Mat off_result;
+			accumulator.sum(on_result, off_result);
+
+			float sum_of_means = 0;
+			for (int i = 0; i < num_frames; ++i) {
+				sum_of_means += frame_means[i];
+			}
+			float mean_of_means = sum_of_means / num_frames;
+			on_result *= mean_of_means;
+			off_result *= mean_of_means;
+
+			cv::Mat result;
+			if (no_subtract) {
+				result = on_result;
+			} else {
+				result = on_result - alpha_fac * off_result;
+			}
+
+			if (!output_folder.empty()) {
+				std::filesystem::path in_path = std::filesystem::path(image_filename).filename();
+				std::filesystem::path out_filename = std::filesystem::path(output_folder) / in_path;
+				if (calibrations.size() > 1) {
+					out_filename.replace_filename(in_path.stem().string() + "_" + std::to_string(direction_idx) + in_path.extension().string());
+				}
+				writer.write(out_filename.string(), result);
+			}
+		}
+	}
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <opencv2/core/core.hpp>
+#include <stdint.h>
+
+// Frames are kept in the depth they were decoded in and only widened to float inside the kernels.
+// These are the depths the kernels take directly, anything else has to be converted first.
+inline bool isNativeDepth(int depth) {
+	return depth == CV_8U || depth == CV_16U || depth == CV_32F;
+}
+
+// Calls fn with a null pointer of the element type of depth, to instantiate a kernel for it:
+//   dispatchNativeDepth(frame.depth(), [&]<typename T>(const T *) { ... frame.ptr<T>(y) ... });
+template <typename Fn>
+void dispatchNativeDepth(int depth, Fn fn) {
+	switch (depth) {
+	case CV_8U:
+		fn((const uint8_t *)nullptr);
+		break;
+	case CV_16U:
+		fn((const uint16_t *)nullptr);
+		break;
+	case CV_32F:
+		fn((const float *)nullptr);
+		break;
+	default:
+		CV_Error(cv::Error::StsUnsupportedFormat, "Frames have to be 8 or 16 bit unsigned or 32 bit float");
+	}
+}
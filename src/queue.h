@@ -0,0 +1,54 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+// Fixed capacity FIFO between threads. push blocks while it is full and pop while it is empty.
+template <typename T>
+class BoundedQueue {
+public:
+	BoundedQueue(size_t capacity)
+		: capacity(capacity), closed(false) {
+	}
+
+	// Returns false if the queue was closed, the item is dropped then
+	bool push(T item) {
+		std::unique_lock<std::mutex> lock(mutex);
+		not_full.wait(lock, [this] { return items.size() < capacity || closed; });
+		if (closed) {
+			return false;
+		}
+		items.push_back(std::move(item));
+		not_empty.notify_one();
+		return true;
+	}
+
+	// Returns false once the queue is closed and all items have been taken
+	bool pop(T & item) {
+		std::unique_lock<std::mutex> lock(mutex);
+		not_empty.wait(lock, [this] { return !items.empty() || closed; });
+		if (items.empty()) {
+			return false;
+		}
+		item = std::move(items.front());
+		items.pop_front();
+		not_full.notify_one();
+		return true;
+	}
+
+	// Wakes up all waiting threads. Items already in the queue can still be popped.
+	void close() {
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		not_full.notify_all();
+		not_empty.notify_all();
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable not_full;
+	std::condition_variable not_empty;
+	std::deque<T> items;
+	size_t capacity;
+	bool closed;
+};
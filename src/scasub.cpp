@@ -6,21 +6,16 @@
 #include <opencv2/opencv.hpp>
 #include "clipp.hpp"
 #include "detect_lines.h"
+#include "deconvolve.h"
+#include "frames.h"
+#include "accumulate.h"
+#include "stack.h"
+#include "pixel_types.h"
 #include <filesystem>
+#include <limits>
+#include <algorithm>
 using namespace clipp;
 
-cv::Mat on_mask(MultiLine lines, cv::Size size, float width = 1.0) {
-	cv::Mat mask(size, CV_32FC1);
-	for (int y = 0; y < size.height; ++y) {
-		for (int x = 0; x < size.width; ++x) {
-			float dist = lines.pointDistance(cv::Point(x, y)) / width;
-			float val = std::exp(-(dist*dist));
-			mask.at<float>(x, y) = val;
-		}
-	}
-	return mask;
-}
-
 int main(int argc, char** argv) {
 	bool help = false;
 	std::vector<std::string> image_filenames;
@@ -31,6 +26,20 @@ int main(int argc, char** argv) {
 	bool debug = false;
 	bool no_subtract = false;
 	bool widefield = false;
+	bool lock_in = false;
+	bool range = false;
+	float percentile = -1;
+	float reassign_fraction = -1;
+	int deconvolve_iterations = 0;
+	float psf_sigma = 1.5;
+	double iteration_budget = 0;
+	float mask_threshold = 0;
+	int threads = 1;
+	bool threads_given = false;
+	int tile_size = 0;
+	int batch_frames = 16;
+	int prefetch = 16;
+	bool track = false;
 
 	auto cli = (
 		option("-h", "--help").set(help) % "Show documentation." |
@@ -38,8 +47,21 @@ int main(int argc, char** argv) {
 			option("-d").set(debug),
 			option("-w").set(widefield),
 			option("--no-subtract").set(no_subtract),
+			option("--range").set(range) % "Per pixel maximum minus minimum over the scan.",
+			option("--percentile") & value("p", percentile) % "Per pixel (1 - p) minus p percentile over the scan, p in [0, 0.5). Estimated with a sketch of 12 values per pixel whatever p and the number of frames, exact for p = 0 and up to 7 frames. Always runs tiled.",
+			option("--reassign") & value("fraction", reassign_fraction) % "Pixel reassignment: moves the signal near every line toward its center by this fraction of its distance (0.5 for ISM) and accumulates it with the on mask. Always frame parallel.",
+			option("--deconvolve") & value("iterations", deconvolve_iterations) % "Reconstructs the specimen from all frames at once with this many Richardson-Lucy iterations, modelling each frame as the on mask times the specimen blurred by a Gaussian PSF. Holds all frames of a file in memory, always frame parallel.",
+			option("--psf") & value("sigma", psf_sigma) % "PSF sigma in pixels for --deconvolve (default 1.5).",
+			option("--budget") & value("seconds", iteration_budget) % "Stop --deconvolve after the first iteration that took longer than this. 0 (default) runs all iterations.",
+			option("--lock-in").set(lock_in) % "Amplitude of the first temporal harmonic of every pixel over the scan instead of the masked subtraction. Needs no masks.",
 			option("-a") & value("alpha factor", alpha_fac),
-			required("-p") & value("points", points),
+			option("-t", "--mask-threshold") & value("threshold", mask_threshold) % "Skip pixels where the mask weight is below threshold. 0 (default) visits every pixel.",
+			option("--threads").set(threads_given) & value("threads", threads) % "Number of frames processed in parallel (default 1), also limits the OpenCV thread pool. Without it OpenCV keeps its default pool.",
+			option("--tile") & value("tile size", tile_size) % "Process the stack in square tiles of this size, tiles run in parallel. 0 (default) processes whole frames.",
+			option("--batch") & value("frames", batch_frames) % "Frames decoded per pass in tiled mode (default 16).",
+			option("--prefetch") & value("frames", prefetch) % "Frames decoded ahead on the reader thread, also across files (default 16).",
+			option("--track").set(track) % "Measure where the lines are in every frame and place its masks there, instead of assuming equal steps.",
+			option("-p") & value("points", points) % "3 line defining points. Without them the lines are detected in the first frame.",
 			required("-b") & value("blacklevel", blacklevel),
 			required("-i") & values("images", image_filenames),
 			option("-o") & value("output folder", output_folder)
@@ -60,127 +82,242 @@ int main(int argc, char** argv) {
 		return 0;
 	}
 
-	auto ps = parsePoints(points);
-	if (ps.size() != 3) {
-		std::cerr << "need 3 input points" << std::endl;
+	// Each mode replaces the masked subtraction, they can not be combined
+	int num_modes = widefield + lock_in + (range || percentile >= 0) + (reassign_fraction >= 0) + (deconvolve_iterations > 0);
+	if (num_modes > 1) {
+		std::cerr << "Only one of -w, --lock-in, --range / --percentile, --reassign and --deconvolve can be given" << std::endl;
+		return 1;
+	}
+	if (range && percentile >= 0) {
+		std::cerr << "Only one of --range and --percentile can be given" << std::endl;
+		return 1;
+	}
+	if (percentile >= 0.5f) {
+		std::cerr << "--percentile has to be below 0.5" << std::endl;
 		return 1;
 	}
-	std::array<cv::Point, 3> line_defining_points;
-	std::copy(ps.begin(), ps.end(), line_defining_points.begin());
-
-	auto lines = MultiLine::fromPoints(line_defining_points, 10);
-
-	std::vector<cv::Mat> masks;
-	std::vector<cv::Mat> off_masks;
-
-
-	std::vector<float> normalization_factors;
-	//Calculate normalization per scanning angle
-	//Actually this should take multiscan into account. But then it gets more complicated...
-	{
-		// Load input images
-		std::vector<cv::Mat> in_images;
-		{
-			std::vector<cv::Mat> read_images;
-			if (!cv::imreadmulti(image_filenames.at(image_filenames.size() - 1), read_images, cv::IMREAD_GRAYSCALE | cv::IMREAD_ANYDEPTH)) {
-				std::cerr << "Could not read images " << image_filenames.at(image_filenames.size() - 1) << std::endl;
-				return 2;
-			}
-			for (auto im : read_images) {
-				cv::Mat fim;
-				im.convertTo(fim, CV_32FC1);
-				in_images.push_back(fim - blacklevel);
-			}
-		}
 
-		std::vector<float> means;
-		float sum_of_means = 0;
-		for (int i = 0; i < in_images.size(); ++i) {
-			float avg = cv::mean(in_images[i])[0];
-			sum_of_means += avg;
-			means.push_back(avg);
+	if (threads_given) {
+		cv::setNumThreads(threads);
+	}
+
+	MultiLine lines;
+	if (points != "") {
+		auto ps = parsePoints(points);
+		if (ps.size() != 3) {
+			std::cerr << "need 3 input points" << std::endl;
+			return 1;
+		}
+		std::array<cv::Point, 3> line_defining_points;
+		std::copy(ps.begin(), ps.end(), line_defining_points.begin());
+		lines = MultiLine::fromPoints(line_defining_points, 10);
+	} else {
+		FrameReader first_reader(image_filenames.at(0));
+		cv::Mat first_frame;
+		if (!first_reader.read(first_frame)) {
+			std::cerr << "Could not read images " << image_filenames.at(0) << std::endl;
+			return 2;
 		}
-		float mean_of_means = sum_of_means / in_images.size();
-		for (int i = 0; i < in_images.size(); ++i) {
-			normalization_factors.push_back(1 / (means[i] / mean_of_means));
+		if (!detect_lines_projection(first_frame, lines)) {
+			std::cerr << "No lines found in the first frame of " << image_filenames.at(0) << ", give them with -p" << std::endl;
+			return 2;
 		}
+		std::cerr << "Detected lines: distance " << lines.distance << ", orientation " << lines.zero_line.orientation << ", offset " << lines.zero_line.offset << std::endl;
 	}
 
+	PhaseLUT on_profile = onProfile(lines.distance);
+	PhaseLUT off_profile = offProfile(lines.distance);
+
+	// Reassignment tables of every frame, kept across files with the same number of frames and frame size
+	bool reassign = reassign_fraction >= 0;
+	std::vector<ReassignmentTable> reassignment_tables;
+	float reassign_threshold = std::max(mask_threshold, 0.01f);
+	// Frames of the file for --deconvolve, and the deconvolver with its DFT buffers, kept across files
+	bool deconvolve = deconvolve_iterations > 0;
+	Stack measured;
+	Deconvolver deconvolver(psf_sigma, threads);
+
+	// Reassigned pixels leave their tile, so reassignment always runs frame parallel, as does
+	// deconvolution, which only stores the frames. The percentile sketch needs every pixel to get its frames
+	// in order, so it always runs tiled.
+	bool sketch = percentile > 0;
+	if (sketch && tile_size <= 0) {
+		tile_size = 64;
+	}
+	BatchAccumulator accumulator(threads, reassign || deconvolve ? 0 : tile_size, batch_frames);
+	QuantileSketch quantile_sketch(std::max(percentile, 0.f));
+
+	// Pages are decoded one at a time on a reader thread, up to prefetch pages ahead, and folded into
+	// the accumulators right away. Results are written on a writer thread while the next file is processed.
+	PrefetchReader reader(image_filenames, prefetch);
+	BackgroundWriter writer(2);
 
 	for (std::string image_filename : image_filenames) {
 		std::cerr << "File " << image_filename << std::endl;
-		// Load input images
-		std::vector<cv::Mat> in_images;
-		{
-			std::vector<cv::Mat> read_images;
-			if (!cv::imreadmulti(image_filename, read_images, cv::IMREAD_GRAYSCALE | cv::IMREAD_ANYDEPTH)) {
-				std::cerr << "Could not read images " << image_filename << std::endl;
-				return 2;
-			}
-			for (auto im : read_images) {
-				cv::Mat fim;
-				im.convertTo(fim, CV_32FC1);
-				in_images.push_back(fim - blacklevel);
-			}
+		if (!reader.nextFile()) {
+			std::cerr << "Could not read images " << image_filename << std::endl;
+			return 2;
 		}
+		int num_frames = reader.size();
 
-		std::vector<float> means;
-		float sum_of_means = 0;
-		for (int i = 0; i < in_images.size(); ++i) {
-			float avg = cv::mean(in_images[i])[0];
-			sum_of_means += avg;
-			means.push_back(avg);
+		std::vector<float> frame_means(num_frames);
+		// --range and --percentile 0 keep the smallest value of every pixel in the on plane and the largest
+		// in the off plane of each worker. Deconvolution and the percentile sketch have no partials,
+		// the other modes have one sum per worker.
+		int rank = range || percentile == 0 ? 1 : 0;
+		int planes = deconvolve || sketch ? 0 : 1;
+		if (reassign && int(reassignment_tables.size()) != num_frames) {
+			reassignment_tables.assign(num_frames, ReassignmentTable());
 		}
-		float mean_of_means = sum_of_means / in_images.size();
-		std::vector<float> normalization_factors;
-		for (int i = 0; i < in_images.size(); ++i) {
-			normalization_factors.push_back(1 / (means[i] / mean_of_means));
+		// Nominal lines of each frame, with --track moved to where they were measured
+		std::vector<LineGeometry> frame_lines;
+		for (int i = 0; i < num_frames; ++i) {
+			frame_lines.push_back(lines.shifted(i, num_frames));
 		}
 
-
-
-		cv::Mat on_result = cv::Mat::zeros(in_images.at(0).size(), CV_32FC1);
-		cv::Mat off_result = cv::Mat::zeros(in_images.at(0).size(), CV_32FC1);
-
-		for (int i = 0; i < in_images.size(); ++i) {
-			if (debug) std::cerr << "Iteration " << i << std::endl;
-			cv::Mat image = in_images.at(i) * normalization_factors[i];
-
-			if (debug) {
-				double min, max;
-				cv::minMaxLoc(image, &min, &max);
-				cv::Mat image_norm = image / max;
-				cv::imshow("in", image_norm);
+		BatchAccumulator::Callbacks callbacks;
+		callbacks.start = [&](cv::Size size) {
+			if (sketch) {
+				quantile_sketch.reset(size);
 			}
+			if (deconvolve && (measured.size() != num_frames || measured.frameSize() != size)) {
+				measured = Stack(num_frames, size, CV_32FC1);
+			}
+			return true;
+		};
 
-			cv::Mat mask;
-			cv::Mat off_mask;
-			if (masks.size() <= i) {
-				MultiLine shifted = lines.shifted(i, in_images.size());
-
-				mask = on_mask(shifted, image.size(), 2.0);
-				masks.push_back(mask);
-				//cv::Mat off_mask = (1.f - mask) * (1.f / (in_images.size() - 1));
-				off_mask = on_mask(shifted.shifted(1, 2), image.size(), 4.0) / 2.f;
-				off_masks.push_back(off_mask);
+		// Blacklevel and normalization are applied by the kernels below
+		callbacks.prepare = [&](const cv::Mat & image, int i) {
+			if (track) {
+				// Same pass as the frame mean
+				double mean;
+				float shift = measureLinePhase(image, blacklevel, frame_lines[i], &mean);
+				frame_lines[i] = frame_lines[i].shifted(shift);
+				frame_means[i] = mean;
 			} else {
-				mask = masks.at(i);
-				off_mask = off_masks.at(i);
+				frame_means[i] = cv::mean(image)[0] - blacklevel;
 			}
-			if (debug) cv::imshow("mask", mask);
-			if (debug) cv::imshow("off_mask", off_mask);
+		};
 
-			if (widefield) {
-				on_result += image;
+		callbacks.accumulate = [&](const cv::Mat & image, int i, cv::Rect roi, int w) {
+			float weight = 1.f / frame_means[i];
+			if (deconvolve) {
+				// Blacklevel removed and normalized, Richardson-Lucy needs them not negative.
+				// Frames are only stored, there are no partials per worker.
+				cv::Mat frame = measured[i];
+				image.convertTo(frame, CV_32FC1, weight, -blacklevel * weight);
+				cv::max(frame, 0, frame);
+				return;
+			}
+			if (sketch) {
+				// Tiles are disjoint and each gets the frames in order
+				quantile_sketch.add(image(roi), roi, i, blacklevel, weight);
+				return;
+			}
+			cv::Mat on_roi = accumulator.onPartials()[w * planes](roi);
+			cv::Mat off_roi = accumulator.offPartials()[w * planes](roi);
+			if (rank > 0) {
+				std::vector<cv::Mat> low = accumulator.onPartials().range(w * rank, rank).frames();
+				std::vector<cv::Mat> high = accumulator.offPartials().range(w * rank, rank).frames();
+				for (int j = 0; j < rank; ++j) {
+					low[j] = low[j](roi);
+					high[j] = high[j](roi);
+				}
+				accumulateOrderStatistics(image(roi), blacklevel, weight, low, high);
+			} else if (widefield) {
+				accumulateWeighted(image(roi), blacklevel, weight, on_roi);
+			} else if (reassign) {
+				// Built by the worker that first gets frame i, with --track for the measured lines of every frame
+				ReassignmentTable tracked_table;
+				const ReassignmentTable * table = &reassignment_tables[i];
+				if (track) {
+					tracked_table = ReassignmentTable(frame_lines[i], image.size(), on_profile, reassign_threshold, reassign_fraction);
+					table = &tracked_table;
+				} else if (table->size != image.size()) {
+					reassignment_tables[i] = ReassignmentTable(frame_lines[i], image.size(), on_profile, reassign_threshold, reassign_fraction);
+				}
+				accumulateReassigned(image, blacklevel, weight, *table, on_roi);
+			} else if (lock_in) {
+				// Scan phase of frame i: how far its lines moved against the unshifted lines, measured with --track
+				double scan_phase = frame_lines[i].phase_0 - LineGeometry(lines).phase_0;
+				accumulateLockIn(image(roi), blacklevel, weight, scan_phase, on_roi, off_roi);
 			} else {
-				on_result += mask.mul(image);
-				off_result += off_mask.mul(image);
+				LineGeometry roi_lines = frame_lines[i].cropped(roi.tl());
+				accumulateOnOff(image(roi), blacklevel, weight, roi_lines, on_profile, off_profile, on_roi, off_roi, mask_threshold);
+			}
+		};
+
+		if (debug) {
+			callbacks.batch_done = [&](const std::vector<cv::Mat> & images, int first_frame, int batch_size) {
+				for (int b = 0; b < batch_size; ++b) {
+					int i = first_frame + b;
+					std::cerr << "Iteration " << i << std::endl;
+					double min, max;
+					cv::minMaxLoc(images[b], &min, &max);
+					cv::Mat image_norm;
+					images[b].convertTo(image_norm, CV_32FC1, 1 / (max - blacklevel), -blacklevel / (max - blacklevel));
+					cv::imshow("in", image_norm);
+
+					cv::imshow("mask", on_profile.render(frame_lines[i], images[b].size()));
+					cv::imshow("off_mask", off_profile.render(frame_lines[i], images[b].size()));
+				}
+			};
+		}
+
+		// Order statistics start from the identities of min and max
+		float on_initial = rank > 0 ? std::numeric_limits<float>::infinity() : 0;
+		float off_initial = rank > 0 ? -std::numeric_limits<float>::infinity() : 0;
+		int frames_read = accumulator.run(reader, num_frames, planes, callbacks, on_initial, off_initial);
+		if (frames_read < 0) {
+			return 2;
+		}
+		if (frames_read == 0) {
+			std::cerr << "Could not read images " << image_filename << std::endl;
+			return 2;
+		}
+
+		cv::Mat on_result;
+		cv::Mat off_result;
+		if (sketch) {
+			// From the frames actually read, a truncated file gives the quantiles of the frames it has
+			quantile_sketch.quantiles(frames_read, on_result, off_result);
+		} else if (rank > 0) {
+			const Stack & on_partial = accumulator.onPartials();
+			const Stack & off_partial = accumulator.offPartials();
+			std::vector<cv::Mat> low = on_partial.range(0, rank).frames();
+			std::vector<cv::Mat> high = off_partial.range(0, rank).frames();
+			for (int w = 1; w < accumulator.numWorkers(); ++w) {
+				mergeOrderStatistics(on_partial.range(w * rank, rank).frames(), off_partial.range(w * rank, rank).frames(), low, high);
 			}
+			// rank-th smallest and largest value of every pixel
+			on_result = low[rank - 1].clone();
+			off_result = high[rank - 1].clone();
+		} else if (deconvolve) {
+			on_result = deconvolver.reconstruct(measured.range(0, frames_read), frame_lines, on_profile, deconvolve_iterations, iteration_budget);
+			off_result = cv::Mat::zeros(on_result.size(), CV_32FC1);
+		} else {
+			accumulator.sum(on_result, off_result);
+		}
 
+		// Frames are normalized to mean_of_means / frame_mean.
+		// mean_of_means is only known after the last frame, so the frames are accumulated
+		// divided by their own mean and the common factor is applied at the end.
+		float sum_of_means = 0;
+		for (int i = 0; i < frames_read; ++i) {
+			sum_of_means += frame_means[i];
 		}
+		float mean_of_means = sum_of_means / frames_read;
+		on_result *= mean_of_means;
+		off_result *= mean_of_means;
 
 		cv::Mat result;
-		if (no_subtract || widefield) {
+		if (rank > 0 || sketch) {
+			result = off_result - on_result;
+		} else if (lock_in) {
+			// on and off hold the cos and sin sums, amplitude of the harmonic
+			cv::magnitude(on_result, off_result, result);
+			result *= 2.f / frames_read;
+		} else if (no_subtract || widefield || reassign || deconvolve) {
 			result = on_result;
 		} else {
 			result = on_result - alpha_fac * off_result;
@@ -198,7 +335,7 @@ int main(int argc, char** argv) {
 
 		if (!output_folder.empty()) {
 			std::filesystem::path out_filename = std::filesystem::path(output_folder) / std::filesystem::path(image_filename).filename();
-			cv::imwrite(out_filename.string(), result);
+			writer.write(out_filename.string(), result);
 		}
 
 		if (debug) {
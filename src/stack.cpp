@@ -0,0 +1,113 @@
+#include "stack.h"
+#include "frames.h"
+#include "pixel_types.h"
+#include <iostream>
+#include <opencv2/imgcodecs.hpp>
+
+Stack::Stack() {
+}
+
+Stack::Stack(int num_frames, cv::Size frame_size, int type, Layout layout)
+	: frame_size(frame_size), layout_(layout) {
+	if (layout == Layout::PixelMajor) {
+		data.create(frame_size.area(), num_frames, type);
+		return;
+	}
+	// Pad every frame to a multiple of 64 bytes, cv::Mat allocations themselves are 64 byte aligned
+	size_t elem_size = CV_ELEM_SIZE(type);
+	size_t frame_bytes = frame_size.area() * elem_size;
+	size_t padded_bytes = cv::alignSize(frame_bytes, 64);
+	int stride = padded_bytes % elem_size == 0 ? padded_bytes / elem_size : frame_size.area();
+	data.create(num_frames, stride, type);
+}
+
+Stack Stack::zeros(int num_frames, cv::Size frame_size, int type, Layout layout) {
+	Stack stack(num_frames, frame_size, type, layout);
+	stack.data.setTo(0);
+	return stack;
+}
+
+Stack Stack::read(std::string filename, int type) {
+	FrameReader reader(filename);
+	if (!reader.isOpened()) {
+		return Stack();
+	}
+	Stack stack;
+	cv::Mat page;
+	int i = 0;
+	while (reader.read(page)) {
+		if (stack.empty()) {
+			if (type < 0) {
+				type = isNativeDepth(page.depth()) ? page.type() : CV_32FC1;
+			}
+			stack = Stack(reader.size(), page.size(), type);
+		}
+		if (page.size() != stack.frameSize()) {
+			std::cerr << "Page " << i << " of " << filename << " has a different size" << std::endl;
+			return Stack();
+		}
+		// Converts straight into the stack memory
+		cv::Mat frame = stack.frame(i);
+		page.convertTo(frame, type);
+		++i;
+	}
+	if (i < stack.size()) {
+		return stack.range(0, i);
+	}
+	return stack;
+}
+
+bool Stack::write(std::string filename) const {
+	return cv::imwrite(filename, frames());
+}
+
+int Stack::size() const {
+	return layout_ == Layout::PixelMajor ? data.cols : data.rows;
+}
+
+bool Stack::empty() const {
+	return size() == 0;
+}
+
+cv::Size Stack::frameSize() const {
+	return frame_size;
+}
+
+int Stack::type() const {
+	return data.type();
+}
+
+Stack::Layout Stack::layout() const {
+	return layout_;
+}
+
+cv::Mat Stack::frame(int i) const {
+	CV_Assert(layout_ == Layout::FrameMajor && i >= 0 && i < size());
+	return data.row(i).colRange(0, frame_size.area()).reshape(0, frame_size.height);
+}
+
+Stack Stack::range(int first, int count) const {
+	Stack stack;
+	stack.data = layout_ == Layout::PixelMajor ? data.colRange(first, first + count) : data.rowRange(first, first + count);
+	stack.frame_size = frame_size;
+	stack.layout_ = layout_;
+	return stack;
+}
+
+std::vector<cv::Mat> Stack::frames() const {
+	std::vector<cv::Mat> frames;
+	for (int i = 0; i < size(); ++i) {
+		frames.push_back(frame(i));
+	}
+	return frames;
+}
+
+cv::Mat Stack::frameMajor() const {
+	CV_Assert(layout_ == Layout::FrameMajor);
+	return data.colRange(0, frame_size.area());
+}
+
+cv::Mat Stack::pixelMajor() const {
+	CV_Assert(layout_ == Layout::PixelMajor);
+	return data;
+}
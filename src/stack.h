@@ -0,0 +1,57 @@
+#pragma once
+#include <opencv2/core/core.hpp>
+#include <string>
+#include <vector>
+
+// Frames of equal size and type in one contiguous allocation.
+// Frame major stacks keep every frame on a 64 byte boundary and hand it out as a zero copy cv::Mat header,
+// so OpenCV functions work on the frames directly.
+// Pixel major stacks keep time innermost instead: all values of a pixel are next to each other, so per pixel
+// loops across frames are contiguous. Their frames have no zero copy header.
+class Stack {
+public:
+	enum class Layout {
+		FrameMajor,
+		PixelMajor,
+	};
+
+	Stack();
+	Stack(int num_frames, cv::Size frame_size, int type, Layout layout = Layout::FrameMajor);
+
+	static Stack zeros(int num_frames, cv::Size frame_size, int type, Layout layout = Layout::FrameMajor);
+
+	// Reads all pages of a multi page image, converted to type. Returns an empty stack on failure.
+	// With type -1 pages keep their decoded type if the kernels widen it on the fly
+	// (see pixel_types.h), other depths are converted to float.
+	static Stack read(std::string filename, int type = CV_32FC1);
+	bool write(std::string filename) const;
+
+	int size() const;
+	bool empty() const;
+	cv::Size frameSize() const;
+	int type() const;
+	Layout layout() const;
+
+	// Zero copy header of frame i, frame major stacks only
+	cv::Mat frame(int i) const;
+	cv::Mat operator[](int i) const {
+		return frame(i);
+	}
+
+	// Zero copy view of count frames starting at first
+	Stack range(int first, int count) const;
+	// Zero copy headers of all frames, for OpenCV functions taking a vector of images
+	std::vector<cv::Mat> frames() const;
+
+	// One row per frame (num_frames x pixels), zero copy, frame major stacks only.
+	// Rows are not continuous if the frames are padded for alignment.
+	cv::Mat frameMajor() const;
+	// One row per pixel (pixels x num_frames), zero copy, pixel major stacks only.
+	// Row p holds pixel p of every frame, pixels are numbered row by row.
+	cv::Mat pixelMajor() const;
+
+private:
+	cv::Mat data; // num_frames x frame stride, or pixels x num_frames
+	cv::Size frame_size;
+	Layout layout_ = Layout::FrameMajor;
+};
@@ -7,6 +7,7 @@
 #include "clipp.hpp"
 #include "detect_lines.h"
 #include "rescale.h"
+#include "stack.h"
 using namespace clipp;
 
 
@@ -76,18 +77,10 @@ int main(int argc, char** argv) {
 	}
 
 	// Load input images
-	std::vector<cv::Mat> in_images;
-	{
-		std::vector<cv::Mat> read_images;
-		if (!cv::imreadmulti(images_filename, read_images, cv::IMREAD_GRAYSCALE | cv::IMREAD_ANYDEPTH)) {
-			std::cerr << "Could not read images" << std::endl;
-			return 2;
-		}
-		for (auto im : read_images) {
-			cv::Mat fim;
-			im.convertTo(fim, CV_32FC1);
-			in_images.push_back(fim);
-		}
+	Stack in_images = Stack::read(images_filename);
+	if (in_images.empty()) {
+		std::cerr << "Could not read images" << std::endl;
+		return 2;
 	}
 
 
@@ -103,19 +96,19 @@ int main(int argc, char** argv) {
 	cv::imshow( "Kalman", img );
 
 	double min, max;
-	cv::minMaxLoc(in_images.at(0), &min, &max);
-	cv::imshow("in", in_images.at(0) / max);
+	cv::minMaxLoc(in_images[0], &min, &max);
+	cv::imshow("in", in_images[0] / max);
 
-	MultiLine lines = detect_lines(in_images.at(0));
+	MultiLine lines = detect_lines(in_images[0]);
 
-	cv::Mat line_im = draw_lines(lines, in_images.at(0).size());
+	cv::Mat line_im = draw_lines(lines, in_images[0].size());
 	cv::imshow("lines", line_im);
 
-	cv::Mat lines_im2 = in_images.at(0).clone();
+	cv::Mat lines_im2 = in_images[0].clone();
 	lines_im2.setTo(0, line_im);
 	cv::imshow("lines2", lines_im2 / max);
 
-	cv::Mat rescaled = rescale_lines(in_images.at(0), lines, 10);
+	cv::Mat rescaled = rescale_lines(in_images[0], lines, 10);
 	cv::imshow("rescaled", rescaled / max);
 
 	while(cv::waitKey(1) != 'q');
@@ -0,0 +1,58 @@
+#include "tiff_writer.h"
+#include <tiffio.h>
+
+TiffWriter::TiffWriter(std::string filename) {
+	tif = TIFFOpen(filename.c_str(), "w8");
+}
+
+TiffWriter::~TiffWriter() {
+	if (tif) {
+		TIFFClose(tif);
+	}
+}
+
+bool TiffWriter::isOpened() {
+	return tif != nullptr;
+}
+
+bool TiffWriter::write(const cv::Mat & frame) {
+	if (!tif) {
+		return false;
+	}
+	int bits;
+	int sample_format;
+	switch (frame.type()) {
+	case CV_8UC1:
+		bits = 8;
+		sample_format = SAMPLEFORMAT_UINT;
+		break;
+	case CV_16UC1:
+		bits = 16;
+		sample_format = SAMPLEFORMAT_UINT;
+		break;
+	case CV_32FC1:
+		bits = 32;
+		sample_format = SAMPLEFORMAT_IEEEFP;
+		break;
+	default:
+		return false;
+	}
+
+	TIFFSetField(tif, TIFFTAG_SUBFILETYPE, FILETYPE_PAGE);
+	TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, frame.cols);
+	TIFFSetField(tif, TIFFTAG_IMAGELENGTH, frame.rows);
+	TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, bits);
+	TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, sample_format);
+	TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);
+	TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+	TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+	TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+	TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(tif, 0));
+
+	for (int y = 0; y < frame.rows; ++y) {
+		if (TIFFWriteScanline(tif, const_cast<uchar *>(frame.ptr(y)), y, 0) < 0) {
+			return false;
+		}
+	}
+	return TIFFWriteDirectory(tif);
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <opencv2/core/core.hpp>
+#include <string>
+
+typedef struct tiff TIFF;
+
+// Appends frames to a multi page TIFF one at a time, so a stack never has to be held in memory.
+// Writes BigTIFF, the file may grow beyond 4 GB.
+// Frames have to be single channel 8 or 16 bit unsigned or 32 bit float.
+class TiffWriter {
+public:
+	TiffWriter(std::string filename);
+	~TiffWriter();
+
+	bool isOpened();
+	bool write(const cv::Mat & frame);
+
+private:
+	TIFF * tif;
+};